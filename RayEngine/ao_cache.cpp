@@ -0,0 +1,83 @@
+#include "ao_cache.h"
+
+AoCache::AoCache() :
+	mask(0),
+	cellSize(0.f),
+	invCellSize(0.f),
+	usedCells(0)
+{
+}
+
+void AoCache::resize(int numCells) {
+
+	uint64_t size = 1;
+	while (size < (uint64_t)numCells)
+		size <<= 1;
+
+	cells.reset(new Cell[size]);
+	mask = size - 1;
+	clear(cellSize);
+
+}
+
+void AoCache::clear(float cellSize) {
+
+	for (uint64_t i = 0; i <= mask && cells; i++) {
+		cells[i].key.store(0, memory_order_relaxed);
+		cells[i].value.store(0, memory_order_relaxed);
+	}
+
+	this->cellSize = cellSize;
+	invCellSize = (cellSize > 0.f) ? 1.f / cellSize : 0.f;
+	usedCells = 0;
+
+}
+
+AoCache::Cell* AoCache::find(Vec3 pos, Vec3 normal) {
+
+	// 19 bits for each coordinate of the cell and 2 for each component of the normal, plus one so
+	// that no key is 0. Cells far enough apart to wrap around share keys, which is left as it is.
+	float p[3] = { pos.x(), pos.y(), pos.z() }, n[3] = { normal.x(), normal.y(), normal.z() };
+	uint64_t key = 0;
+	for (int i = 0; i < 3; i++) {
+		uint64_t coord = (uint64_t)((int64_t)floor(p[i] * invCellSize) + (1 << 18)) & 0x7FFFF;
+		uint64_t dir = (uint64_t)clamp((n[i] + 1.f) * 2.f, 0.f, 3.f);
+		key = (key << 21) | (coord << 2) | dir;
+	}
+	key++;
+
+	// Mix the bits for the index, then probe the next cells
+	uint64_t hash = key;
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+
+	for (int i = 0; i < AO_CACHE_PROBES; i++) {
+
+		Cell& cell = cells[(hash + i) & mask];
+		uint64_t cellKey = cell.key.load(memory_order_relaxed);
+		if (cellKey == key)
+			return &cell;
+
+		if (cellKey == 0) {
+			// Claim it, unless another thread got there first with its own point
+			if (cell.key.compare_exchange_strong(cellKey, key, memory_order_relaxed)) {
+				usedCells++;
+				return &cell;
+			}
+			if (cellKey == key)
+				return &cell;
+		}
+
+	}
+
+	return nullptr;
+
+}
+
+float AoCache::add(Cell* cell, int samples, float occluded) {
+
+	uint64_t added = ((uint64_t)samples << 32) + (uint64_t)(occluded * AO_CACHE_PRECISION + 0.5f);
+	return getMean(cell->value.fetch_add(added, memory_order_relaxed) + added);
+
+}
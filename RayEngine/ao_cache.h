@@ -0,0 +1,44 @@
+#pragma once
+
+#include "util.h"
+#include "vec3.h"
+#include "settings.h"
+
+#include <atomic>
+#include <memory>
+
+// Running AO estimates of surface points in a hash table, keyed by the world-space cell of the
+// point and a coarse direction of its normal. The threads share it without locks: an empty cell
+// is claimed with a compare and swap of its key, and samples are added to a cell with one atomic
+// add of a word holding both its sample count and its summed occlusion.
+struct AoCache {
+
+	AoCache();
+
+	// Allocates the table with numCells rounded up to a power of two, empty
+	void resize(int numCells);
+
+	// Empties every cell and sets the size of the cells in world units
+	void clear(float cellSize);
+
+	struct Cell {
+		atomic<uint64_t> key; // 0 when empty
+		atomic<uint64_t> value; // Samples in the high 32 bits, summed occlusion in steps of 1 / AO_CACHE_PRECISION in the low
+	};
+
+	// Returns the cell of a point and normal, claiming an empty one if it isn't in the table yet.
+	// Returns nullptr if the cells probed for it hold other points.
+	Cell* find(Vec3 pos, Vec3 normal);
+
+	// Adds samples with a summed occlusion to a cell and returns its new mean occlusion
+	static float add(Cell* cell, int samples, float occluded);
+
+	static __forceinline uint getSamples(uint64_t value) { return (uint)(value >> 32); }
+	static __forceinline float getMean(uint64_t value) { return getSamples(value) ? (float)(uint)value / (AO_CACHE_PRECISION * getSamples(value)) : 0.f; }
+
+	unique_ptr<Cell[]> cells;
+	uint64_t mask;
+	float cellSize, invCellSize;
+	atomic<int> usedCells;
+
+};
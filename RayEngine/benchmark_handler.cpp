@@ -20,6 +20,23 @@ void RayEngine::benchmarkStart() {
 
 	benchmarkMode = true;
 	LOG(date() + " Started benchmark");
+	LOG(settingEmbreePacketWidth->getLogText());
+	LOG(settingEmbreeNumThreads->getLogText());
+	LOG(settingEmbreeEnableNuma->getLogText());
+	LOG(settingEmbreeEnableCostScheduling->getLogText());
+	LOG(settingEmbreeEnableAdaptiveTiles->getLogText());
+	LOG(settingAoEnableAdaptive->getLogText());
+	LOG(settingAoEnableCache->getLogText());
+	if (enableAoCache)
+		LOG(settingAoCacheCell->getLogText());
+	LOG(settingEmbreeEnableBudget->getLogText());
+	LOG(settingEmbreeEnableDynamicResolution->getLogText());
+	LOG(settingEmbreeEnableCache->getLogText());
+	LOG(settingEmbreeEnableCheckerboard->getLogText());
+	if (Embree.enableDynamicResolution)
+		LOG(settingEmbreeTargetTime->getLogText());
+	if (Embree.enableBudget)
+		LOG(settingEmbreeBudget->getLogText());
 
 	if (curScene->cameraPath)
 		curScene->cameraPath->frame = 0.f;
@@ -52,7 +69,12 @@ void RayEngine::benchmarkUpdate() {
 	}
 
 	if (renderMode == RM_EMBREE)
-		LOG(frameColumn + to_string_prec(Embree.renderTimer.lastTime, 4));
+		LOG(frameColumn + to_string_prec(Embree.renderTimer.lastTime, 4) + "\t" + to_string_prec(Embree.tailTime, 4) + "\t" + to_string_prec(Embree.resolveTimer.lastTime, 4) +
+			(Embree.enableTiles && Embree.enableBudget ? "\t" + to_string(Embree.skippedTiles) + " skipped" : "") +
+			(Embree.enableDynamicResolution ? "\t" + to_string_prec(Embree.frame.scale, 2) + " scale" : "") +
+			(enableAo ? "\t" + to_string_prec(Embree.aoSamplesPerHit, 2) + " AO samples/hit" : "") +
+			(Embree.enableCache ? "\t" + to_string_prec(Embree.cacheHitRate * 100.f, 1) + "% cache hits" : "") +
+			(Embree.enableCheckerboard ? "\t" + to_string_prec(Embree.checkerReuse * 100.f, 1) + "% checker reuse" : ""));
 	else if (renderMode == RM_OPTIX)
 		LOG(frameColumn + to_string_prec(Optix.renderTimer.lastTime, 4));
 	else
@@ -63,4 +85,544 @@ void RayEngine::benchmarkUpdate() {
 			to_string_prec(Optix.renderTimer.lastTime, 4)
 		);
 
-}
\ No newline at end of file
+}
+
+// Renders every scene with the single ray, naive packet and binned packet paths for secondary
+// rays and logs the average render time of each
+void RayEngine::benchmarkSecondary() {
+
+	struct SecondaryPath {
+		string name;
+		bool wavefront, packetsPrimary, packetsSecondary, binning;
+	};
+
+	// The wavefront runs with and without binning, so that the gain of binning is measured apart
+	// from the gain of the wavefront itself
+	SecondaryPath paths[] = {
+		{ "Single rays",      false, true, false, false },
+		{ "Naive packets",    false, true, true,  false },
+		{ "Wavefront",        true,  true, false, false },
+		{ "Wavefront binned", true,  true, false, true  }
+	};
+
+	Scene* prevScene = curScene;
+	bool prevWavefront = Embree.enableWavefront;
+	bool prevPacketsPrimary = Embree.enablePacketsPrimary;
+	bool prevPacketsSecondary = Embree.enablePacketsSecondary;
+	bool prevBinning = Embree.enableBinning;
+
+	LOG(date() + " Started secondary ray benchmark (" + to_string(BENCHMARK_SECONDARY_FRAMES) + " frames per path)");
+	LOG(settingEmbreePacketWidth->getLogText());
+
+	for (Scene* scene : scenes) {
+
+		curScene = scene;
+		curCamera = &curScene->camera;
+		embreeUpdateTraceKernel();
+
+		for (SecondaryPath& path : paths) {
+
+			// The paths are part of the frame, so every path builds its own
+			Embree.enableWavefront = path.wavefront;
+			Embree.enablePacketsPrimary = path.packetsPrimary;
+			Embree.enablePacketsSecondary = path.packetsSecondary;
+			Embree.enableBinning = path.binning;
+			FrameState frame = frameBuild();
+
+			for (Embree::Wavefront& wavefront : Embree.wavefronts) {
+				wavefront.shadowCount.clear();
+				wavefront.shadowSingleCount.clear();
+				wavefront.shadowTime.clear();
+			}
+
+			float total = 0.f;
+			uint filterCalls = 0;
+			for (int f = 0; f < BENCHMARK_SECONDARY_FRAMES; f++) {
+				embreeRender(frame);
+				total += Embree.renderTimer.lastTime;
+				filterCalls += Embree.filterCalls;
+			}
+
+			string result = scene->name + "\t" + path.name + "\t" + to_string_prec(total / BENCHMARK_SECONDARY_FRAMES, 4) + "\t" + to_string(filterCalls / BENCHMARK_SECONDARY_FRAMES) + " filter calls";
+			cout << result << endl;
+			LOG(result);
+
+			// Shadow ray throughput per light (million rays per thread second)
+			if (path.wavefront) {
+				for (uint l = 0; l < scene->lights.size(); l++) {
+
+					double rays = 0.0, single = 0.0, time = 0.0;
+					for (Embree::Wavefront& wavefront : Embree.wavefronts) {
+						if (l < wavefront.shadowCount.size()) {
+							rays += wavefront.shadowCount[l];
+							single += wavefront.shadowSingleCount[l];
+							time += wavefront.shadowTime[l];
+						}
+					}
+
+					string lightResult = scene->name + "\t" + path.name + "\tLight " + to_string(l) + "\t" +
+										 to_string_prec(time > 0.0 ? rays / time * 0.000001 : 0.0, 4) + " Mrays/s\t" +
+										 to_string_prec(rays > 0.0 ? single / rays * 100.0 : 0.0, 2) + "% single";
+					cout << lightResult << endl;
+					LOG(lightResult);
+
+				}
+			}
+
+		}
+
+	}
+
+	LOG(date() + " Stopped secondary ray benchmark");
+
+	curScene = prevScene;
+	curCamera = &curScene->camera;
+	embreeUpdateTraceKernel();
+	Embree.enableWavefront = prevWavefront;
+	Embree.enablePacketsPrimary = prevPacketsPrimary;
+	Embree.enablePacketsSecondary = prevPacketsSecondary;
+	Embree.enableBinning = prevBinning;
+
+}
+
+// Decodes the primary hits of the current view through the instance/geometry maps and through
+// the hit decode table, and logs the average time per hit of each
+void RayEngine::benchmarkHitDecode() {
+
+	// Collect hits, over the columns of the frame Embree renders
+	FrameState frame = frameBuild();
+	vector<Embree::Ray> hits;
+	for (int y = 0; y < frame.height; y++) {
+		for (int x = 0; x < frame.embreeWidth; x++) {
+
+			float dx = ((float)(frame.embreeOffset + x) / frame.width) * 2.f - 1.f;
+			float dy = ((float)y / frame.height) * 2.f - 1.f;
+			Vec3 rayDir = dx * frame.rayXaxis + dy * frame.rayYaxis + frame.rayZaxis;
+
+			Embree::Ray ray;
+			ray.org[0] = frame.rayOrg.x();
+			ray.org[1] = frame.rayOrg.y();
+			ray.org[2] = frame.rayOrg.z();
+			ray.dir[0] = rayDir.x();
+			ray.dir[1] = rayDir.y();
+			ray.dir[2] = rayDir.z();
+			ray.tnear = 0.01f;
+			ray.tfar = FLT_MAX;
+			ray.instID =
+			ray.geomID =
+			ray.primID = RTC_INVALID_GEOMETRY_ID;
+			ray.mask = EMBREE_RAY_VALID;
+			ray.time = 0.f;
+			rtcIntersect(curScene->Embree.scene, ray);
+
+			if (ray.geomID != RTC_INVALID_GEOMETRY_ID)
+				hits.push_back(ray);
+
+		}
+	}
+
+	if (hits.empty())
+		return;
+
+	// The sums are logged so the decoding can't be optimized away
+	float mapSum = 0.f, tableSum = 0.f;
+
+	double mapStart = glfwGetTime();
+	for (int r = 0; r < BENCHMARK_DECODE_REPEATS; r++) {
+		for (Embree::Ray& ray : hits) {
+			Object* obj = curScene->Embree.instIDmap.at(ray.instID);
+			TriangleMesh* mesh = (TriangleMesh*)obj->Embree.geomIDmap.at(ray.geomID);
+			Vec3 normal = obj->matrix * mesh->getNormal(ray.primID, ray.u, ray.v);
+			Vec2 texCoord = mesh->getTexCoord(ray.primID, ray.u, ray.v);
+			mapSum += normal.x() + texCoord.x() + mesh->material->ambient.r() + mesh->material->shineExponent;
+		}
+	}
+	double mapTime = glfwGetTime() - mapStart;
+
+	double tableStart = glfwGetTime();
+	for (int r = 0; r < BENCHMARK_DECODE_REPEATS; r++) {
+		for (Embree::Ray& ray : hits) {
+			const EmbreeHitDecode& decode = curScene->Embree.getHit(ray.instID, ray.geomID);
+			Vec3 normal = decode.getNormal(ray.primID, ray.u, ray.v);
+			Vec2 texCoord = decode.getTexCoord(ray.primID, ray.u, ray.v);
+			tableSum += normal.x() + texCoord.x() + decode.ambient.r() + decode.shineExponent;
+		}
+	}
+	double tableTime = glfwGetTime() - tableStart;
+
+	double numDecodes = (double)hits.size() * BENCHMARK_DECODE_REPEATS;
+	string result =
+		curScene->name + "\t" + to_string(hits.size()) + " hits" +
+		"\tMaps: " + to_string_prec(mapTime / numDecodes * 1000000000.0, 2) + " ns/hit" +
+		"\tTable: " + to_string_prec(tableTime / numDecodes * 1000000000.0, 2) + " ns/hit" +
+		"\t(" + to_string_prec(mapSum, 0) + ", " + to_string_prec(tableSum, 0) + ")";
+
+	LOG(date() + " Hit decode benchmark (" + to_string(BENCHMARK_DECODE_REPEATS) + " repeats)");
+	LOG(result);
+	cout << result << endl;
+
+}
+
+// Renders the current view with the threads of one NUMA node, with the threads of every node
+// pinned to their nodes, and unpinned, and logs the average render times and the scaling
+void RayEngine::benchmarkNuma() {
+
+	struct NumaConfig {
+		string name;
+		int numThreads, numNodes;
+	};
+
+	int numNodes = numaGetNumNodes();
+	int prevNumThreads = Embree.numThreads;
+
+	NumaConfig configs[] = {
+		{ "1 node",              max(prevNumThreads / numNodes, 1), 1        },
+		{ "All nodes",           prevNumThreads,                    numNodes },
+		{ "All nodes, unpinned", prevNumThreads,                    0        }
+	};
+
+	LOG(date() + " Started NUMA benchmark (" + to_string(numNodes) + " nodes, " + to_string(BENCHMARK_NUMA_FRAMES) + " frames per configuration)");
+	LOG(settingEmbreeEnableNumaReplication->getLogText());
+
+	FrameState frame = frameBuild();
+	float oneNodeTime = 0.f;
+	for (NumaConfig& config : configs) {
+
+		Embree.numThreads = config.numThreads;
+		embreeUpdateThreads(config.numNodes);
+
+		// Warm up, placing the buffer and scratch memory
+		embreeRender(frame);
+
+		float total = 0.f;
+		for (int f = 0; f < BENCHMARK_NUMA_FRAMES; f++) {
+			embreeRender(frame);
+			total += Embree.renderTimer.lastTime;
+		}
+		total /= BENCHMARK_NUMA_FRAMES;
+
+		if (config.numNodes == 1)
+			oneNodeTime = total;
+
+		string result = curScene->name + "\t" + config.name + "\t" + to_string(config.numThreads) + " threads\t" +
+						to_string_prec(total, 4) + "\t" + to_string_prec(total > 0.f ? oneNodeTime / total : 0.f, 3) + "x";
+		cout << result << endl;
+		LOG(result);
+
+	}
+
+	LOG(date() + " Stopped NUMA benchmark");
+
+	Embree.numThreads = prevNumThreads;
+	embreeUpdateThreads();
+
+}
+
+// Renders every frame of the camera path of BENCHMARK_TILES_SCENE with the tiles in Morton order,
+// ordered by cost and adaptive, and logs the average render time, the average and worst tail and the
+// average time of resolving the tiled buffer into the image of each
+void RayEngine::benchmarkTiles() {
+
+	struct TileConfig {
+		string name;
+		bool costScheduling, adaptiveTiles;
+	};
+
+	TileConfig configs[] = {
+		{ "Morton order",    false, false },
+		{ "Cost scheduling", true,  false },
+		{ "Adaptive tiles",  true,  true  }
+	};
+
+	Scene* scene = nullptr;
+	for (Scene* s : scenes)
+		if (s->name == BENCHMARK_TILES_SCENE)
+			scene = s;
+	if (!scene || !scene->cameraPath)
+		return;
+
+	Scene* prevScene = curScene;
+	Camera prevCamera = scene->camera;
+	bool prevTiles = Embree.enableTiles;
+	bool prevCostScheduling = Embree.enableCostScheduling;
+	bool prevAdaptiveTiles = Embree.enableAdaptiveTiles;
+
+	curScene = scene;
+	curCamera = &curScene->camera;
+	embreeUpdateTraceKernel();
+	Embree.enableTiles = true;
+
+	int numFrames = (int)(BENCHMARK_TARGET_FPS * scene->cameraPath->time);
+	LOG(date() + " Started tile scheduling benchmark (" + scene->name + " camera path, " + to_string(numFrames) + " frames per configuration)");
+	LOG(settingEmbreeTileWidth->getLogText());
+	LOG(settingEmbreeTileHeight->getLogText());
+
+	for (TileConfig& config : configs) {
+
+		// Every configuration starts without the costs of the last
+		Embree.enableCostScheduling = config.costScheduling;
+		Embree.enableAdaptiveTiles = config.adaptiveTiles;
+		Embree.costTilesX = Embree.costTilesY = 0;
+		scene->cameraPath->frame = 0.f;
+
+		float total = 0.f, tailTotal = 0.f, tailMax = 0.f, resolveTotal = 0.f;
+		for (int f = 0; f < numFrames; f++) {
+			scene->updateCameraPath(true);
+			embreeRender(frameBuild());
+			total += Embree.renderTimer.lastTime;
+			resolveTotal += Embree.resolveTimer.lastTime;
+			tailTotal += Embree.tailTime;
+			tailMax = max(tailMax, Embree.tailTime);
+		}
+
+		string result = scene->name + "\t" + config.name + "\t" + to_string_prec(total / numFrames, 4) + "\t" +
+						to_string_prec(tailTotal / numFrames, 4) + " avg tail\t" + to_string_prec(tailMax, 4) + " worst tail\t" +
+						to_string_prec(resolveTotal / numFrames, 4) + " resolve";
+		cout << result << endl;
+		LOG(result);
+
+	}
+
+	LOG(date() + " Stopped tile scheduling benchmark");
+
+	scene->camera = prevCamera;
+	scene->cameraPath->frame = 0.f;
+	curScene = prevScene;
+	curCamera = &curScene->camera;
+	embreeUpdateTraceKernel();
+	Embree.enableTiles = prevTiles;
+	Embree.enableCostScheduling = prevCostScheduling;
+	Embree.enableAdaptiveTiles = prevAdaptiveTiles;
+
+}
+
+// Renders the current view without and with the AO cache on the single ray and packet paths, and
+// logs the frame times and the RMS difference of the cached image from the uncached one
+void RayEngine::benchmarkAoCache() {
+
+	struct AoCachePath {
+		string name;
+		bool packetsPrimary, packetsSecondary;
+	};
+
+	AoCachePath paths[] = {
+		{ "Single rays", false, false },
+		{ "Packets",     true,  true  }
+	};
+
+	bool prevAo = enableAo;
+	bool prevAoCache = enableAoCache;
+	bool prevWavefront = Embree.enableWavefront;
+	bool prevPacketsPrimary = Embree.enablePacketsPrimary;
+	bool prevPacketsSecondary = Embree.enablePacketsSecondary;
+
+	enableAo = true;
+	embreeUpdateTraceKernel();
+	Embree.enableWavefront = false;
+
+	LOG(date() + " Started AO cache benchmark (" + curScene->name + ", " + to_string(BENCHMARK_AO_CACHE_FRAMES) + " frames per path)");
+	LOG(settingAoSamples->getLogText());
+	LOG(settingAoEnableAdaptive->getLogText());
+	LOG(settingAoCacheCell->getLogText());
+
+	for (AoCachePath& path : paths) {
+
+		Embree.enablePacketsPrimary = path.packetsPrimary;
+		Embree.enablePacketsSecondary = path.packetsSecondary;
+
+		// Uncached, after a frame of warm up. The frames have the same noise, so any of them is the reference.
+		enableAoCache = false;
+		FrameState frame = frameBuild();
+		embreeRender(frame);
+
+		float uncachedTotal = 0.f;
+		for (int f = 0; f < BENCHMARK_AO_CACHE_FRAMES; f++) {
+			embreeRender(frame);
+			uncachedTotal += Embree.renderTimer.lastTime;
+		}
+		vector<Color> reference = Embree.image;
+
+		// Cached from an empty table, so the first frame shows the cost of filling the cells
+		enableAoCache = true;
+		frame = frameBuild();
+		Embree.aoCacheScene = nullptr;
+
+		float cachedTotal = 0.f, firstTime = 0.f;
+		for (int f = 0; f < BENCHMARK_AO_CACHE_FRAMES; f++) {
+			embreeRender(frame);
+			cachedTotal += Embree.renderTimer.lastTime;
+			if (f == 0)
+				firstTime = Embree.renderTimer.lastTime;
+		}
+
+		// RMS difference over the color channels of the last cached frame
+		double error = 0.0;
+		size_t size = min(reference.size(), Embree.image.size());
+		for (size_t i = 0; i < size; i++) {
+			float r = Embree.image[i].r() - reference[i].r(), g = Embree.image[i].g() - reference[i].g(), b = Embree.image[i].b() - reference[i].b();
+			error += r * r + g * g + b * b;
+		}
+		float rms = size ? (float)sqrt(error / (size * 3)) : 0.f;
+
+		string result = curScene->name + "\t" + path.name + "\t" + to_string_prec(uncachedTotal / BENCHMARK_AO_CACHE_FRAMES, 4) + " uncached\t" +
+						to_string_prec(cachedTotal / BENCHMARK_AO_CACHE_FRAMES, 4) + " cached\t" + to_string_prec(firstTime, 4) + " first cached\t" +
+						to_string_prec(Embree.aoSamplesPerHit, 2) + " AO samples/hit\t" + to_string(Embree.aoCache.usedCells) + " cells\t" +
+						to_string_prec(rms, 4) + " RMS";
+		cout << result << endl;
+		LOG(result);
+
+	}
+
+	LOG(date() + " Stopped AO cache benchmark");
+
+	enableAo = prevAo;
+	embreeUpdateTraceKernel();
+	enableAoCache = prevAoCache;
+	Embree.enableWavefront = prevWavefront;
+	Embree.enablePacketsPrimary = prevPacketsPrimary;
+	Embree.enablePacketsSecondary = prevPacketsSecondary;
+
+}
+
+// Renders every frame of a camera path with every pixel traced and as a checkerboard, and logs the
+// average frame times, reconstruction included, and the RMS difference of the checkerboard frames from the full ones. The
+// full frame of each camera is rendered first, and the buffer and last frame of the checkerboard
+// are put back after it, so the checkerboard frames only see each other.
+void RayEngine::benchmarkCheckerboard() {
+
+	Scene* scene = nullptr;
+	for (Scene* s : scenes)
+		if (s->name == BENCHMARK_CHECKER_SCENE)
+			scene = s;
+	if (!scene || !scene->cameraPath)
+		return;
+
+	Scene* prevScene = curScene;
+	Camera prevCamera = scene->camera;
+	bool prevCheckerboard = Embree.enableCheckerboard;
+	bool prevCache = Embree.enableCache;
+
+	curScene = scene;
+	curCamera = &curScene->camera;
+	embreeUpdateTraceKernel();
+	Embree.enableCache = false; // It would reuse the full frames
+	scene->cameraPath->frame = 0.f;
+
+	int numFrames = (int)(BENCHMARK_TARGET_FPS * scene->cameraPath->time);
+	LOG(date() + " Started checkerboard benchmark (" + scene->name + " camera path, " + to_string(numFrames) + " frames)");
+
+	vector<Color> checkerBuffer;
+	float fullTotal = 0.f, checkerTotal = 0.f, reuseTotal = 0.f;
+	double error = 0.0;
+	size_t errorCount = 0;
+
+	for (int f = 0; f < numFrames; f++) {
+
+		scene->updateCameraPath(true);
+
+		// Every pixel traced
+		Embree.enableCheckerboard = false;
+		FrameState lastChecker = Embree.checkerFrame;
+		checkerBuffer.assign(Embree.buffer.begin(), Embree.buffer.end());
+		double start = WorkerPool::getSeconds();
+		embreeRender(frameBuild());
+		fullTotal += (float)(WorkerPool::getSeconds() - start);
+		vector<Color> reference = Embree.image;
+		if (checkerBuffer.size() == Embree.buffer.size())
+			copy(checkerBuffer.begin(), checkerBuffer.end(), Embree.buffer.begin());
+		Embree.checkerFrame = lastChecker;
+
+		// Half the pixels, numbered so that every frame takes the last one's
+		Embree.enableCheckerboard = true;
+		FrameState frame = frameBuild();
+		frame.number = f + 1;
+		start = WorkerPool::getSeconds();
+		embreeRender(frame);
+		checkerTotal += (float)(WorkerPool::getSeconds() - start);
+		reuseTotal += Embree.checkerReuse;
+
+		size_t size = min(reference.size(), Embree.image.size());
+		for (size_t i = 0; i < size; i++) {
+			float r = Embree.image[i].r() - reference[i].r(), g = Embree.image[i].g() - reference[i].g(), b = Embree.image[i].b() - reference[i].b();
+			error += r * r + g * g + b * b;
+		}
+		errorCount += size * 3;
+
+	}
+
+	float rms = errorCount ? (float)sqrt(error / errorCount) : 0.f;
+	string result = scene->name + "\t" + to_string_prec(fullTotal / numFrames, 4) + " full\t" + to_string_prec(checkerTotal / numFrames, 4) + " checkerboard\t" +
+					to_string_prec(checkerTotal > 0.f ? fullTotal / checkerTotal : 0.f, 3) + "x\t" + to_string_prec(reuseTotal / numFrames * 100.f, 1) + "% checker reuse\t" +
+					to_string_prec(rms, 4) + " RMS";
+	cout << result << endl;
+	LOG(result);
+	LOG(date() + " Stopped checkerboard benchmark");
+
+	scene->camera = prevCamera;
+	scene->cameraPath->frame = 0.f;
+	curScene = prevScene;
+	curCamera = &curScene->camera;
+	embreeUpdateTraceKernel();
+	Embree.enableCheckerboard = prevCheckerboard;
+	Embree.enableCache = prevCache;
+
+}
+
+// Renders the current view with primary packets, shading their hits per lane in SIMD registers and
+// then one hit at a time, and logs the frame times and the shaded hits per second of both
+void RayEngine::benchmarkShading() {
+
+	struct ShadingPath {
+		string name;
+		bool packetsSecondary;
+	};
+
+	ShadingPath paths[] = {
+		{ "AoS hits",    false },
+		{ "SIMD packets", true }
+	};
+
+	bool prevWavefront = Embree.enableWavefront;
+	bool prevPacketsPrimary = Embree.enablePacketsPrimary;
+	bool prevPacketsSecondary = Embree.enablePacketsSecondary;
+
+	Embree.enableWavefront = false;
+	Embree.enablePacketsPrimary = true;
+
+	LOG(date() + " Started shading benchmark (" + curScene->name + ", " + to_string(BENCHMARK_SHADING_FRAMES) + " frames per path)");
+	LOG(settingEmbreePacketWidth->getLogText());
+
+	float hitsPerSecond[2] = { 0.f, 0.f };
+	for (int p = 0; p < 2; p++) {
+
+		// After a frame of warm up
+		Embree.enablePacketsSecondary = paths[p].packetsSecondary;
+		FrameState frame = frameBuild();
+		embreeRender(frame);
+
+		float total = 0.f;
+		double hits = 0.0;
+		for (int f = 0; f < BENCHMARK_SHADING_FRAMES; f++) {
+			embreeRender(frame);
+			total += Embree.renderTimer.lastTime;
+			hits += Embree.shadedHits;
+		}
+		hitsPerSecond[p] = total > 0.f ? (float)(hits / total) : 0.f;
+
+		string result = curScene->name + "\t" + paths[p].name + "\t" + to_string_prec(total / BENCHMARK_SHADING_FRAMES, 4) + "\t" +
+						to_string((uint)(hits / BENCHMARK_SHADING_FRAMES)) + " shaded hits\t" + to_string_prec(hitsPerSecond[p] / 1000000.f, 3) + " Mhits/s";
+		cout << result << endl;
+		LOG(result);
+
+	}
+
+	string result = curScene->name + "\t" + to_string_prec(hitsPerSecond[0] > 0.f ? hitsPerSecond[1] / hitsPerSecond[0] : 0.f, 3) + "x SIMD over AoS";
+	cout << result << endl;
+	LOG(result);
+	LOG(date() + " Stopped shading benchmark");
+
+	Embree.enableWavefront = prevWavefront;
+	Embree.enablePacketsPrimary = prevPacketsPrimary;
+	Embree.enablePacketsSecondary = prevPacketsSecondary;
+
+}
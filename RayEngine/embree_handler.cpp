@@ -1,16 +1,44 @@
 #include "rayengine.h"
+#include <intrin.h>
 
 void* userData;
 
+// Builds the scene's BVH on the threads of the pool
+static void embreeCommit(RTCScene scene, WorkerPool& pool) {
+
+	int numWorkers = pool.getNumWorkers();
+	pool.runOnEachWorker([&](int index) {
+		rtcCommitThread(scene, index, numWorkers);
+	});
+
+}
+
 void RayEngine::embreeInit() {
 
 	cout << "Starting Embree..." << endl;
 
-	// Init library
-	Embree.device = rtcNewDevice(NULL);
+	// Start worker threads, restarted when the setting is changed. They are the only threads
+	// doing CPU work, so there are never more of them than hardware threads.
+	Embree.numThreads = EMBREE_NUM_THREADS ? min(EMBREE_NUM_THREADS, WorkerPool::getNumHardwareThreads()) : WorkerPool::getNumHardwareThreads();
+	Embree.enableNuma = EMBREE_ENABLE_NUMA;
+	Embree.enableNumaReplication = EMBREE_ENABLE_NUMA_REPLICATION;
+	embreeUpdateThreads();
+
+	// Init library without threads of its own, the scenes are built by the workers of the pool
+	// joining the commit (see embreeCommit), as many as there can be
+	Embree.device = rtcNewDevice(("threads=1,user_threads=" + to_string(WorkerPool::getNumHardwareThreads())).c_str());
 	_MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 	_MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 
+	Embree.orderTilesX = Embree.orderTilesY = 0;
+	Embree.costTilesX = Embree.costTilesY = 0;
+	Embree.tiledBuffer = false;
+
+	// Pick packet width
+	Embree.maxPacketWidth = embreeDetectPacketWidth();
+	Embree.packetWidth = EMBREE_PACKET_WIDTH ? min(EMBREE_PACKET_WIDTH, Embree.maxPacketWidth) : Embree.maxPacketWidth;
+	cout << "Embree packet width: " << Embree.packetWidth << endl;
+
 	// Generate texture
 	glGenTextures(1, &Embree.texture);
 	glBindTexture(GL_TEXTURE_2D, Embree.texture);
@@ -18,31 +46,210 @@ void RayEngine::embreeInit() {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
+	Embree.filterCalls = Embree.shadedHits = 0;
+	Embree.skippedTiles = 0;
+	Embree.tailTime = Embree.idleTime = 0.f;
+	Embree.steals = 0;
+	Embree.aoSamplesPerHit = 0.f;
+	Embree.cacheReuse = false;
+	Embree.cacheHitRate = 0.f;
+	Embree.cacheFrame.scene = nullptr;
+	Embree.cacheFrame.number = 0;
+	Embree.aoCacheScene = nullptr;
+	Embree.checkerHistory = false;
+	Embree.checkerStep = 1;
+	Embree.checkerReuse = 0.f;
+	Embree.checkerFrame.enableCheckerboard = false;
+	Embree.checkerFrame.number = 0;
+	Embree.checkerFrame.checkerParity = 0;
+	Embree.accumulatedView = Embree.accumulatedFrames = 0;
+	Embree.displayFrame.width = Embree.displayFrame.height = 0;
+	Embree.displayFrame.windowWidth = Embree.displayFrame.windowHeight = 0;
+	Embree.displayFrame.scale = 1.f;
+	Embree.scale = 1.f;
+	Embree.pixelCost = 0.f;
+	Embree.upscaleSrcWidth = Embree.upscaleSrcHeight = Embree.upscaleWidth = 0;
+	Embree.displayUploaded = true;
+	Embree.displayStats = {};
+
+	// Init kernels
+	embreeInitTraceKernels();
+	embreeInitPacketKernels();
+	embreeUpdateTraceKernel();
+
 	// Init scenes
 	userData = this;
 	for (uint i = 0; i < scenes.size(); i++)
-		scenes[i]->embreeInit(Embree.device);
+		scenes[i]->embreeInit(Embree.device, Embree.pool);
+
+	// Place the scenes' tables
+	embreeUpdateThreads();
+
+	// The render thread waits for the first frame
+	embreeStartRenderThread();
 
 }
 
-void Scene::embreeInit(RTCDevice device) {
+// Restarts the worker pool if the thread or NUMA settings changed, and copies the
+// hit decode tables to the nodes. The number of nodes to pin to can be overridden.
+void RayEngine::embreeUpdateThreads(int numNodes) {
+
+	if (numNodes < 0)
+		numNodes = Embree.enableNuma ? numaGetNumNodes() : 0;
+	numNodes = min(numNodes, Embree.numThreads);
+
+	if (Embree.pool.getNumWorkers() != Embree.numThreads || Embree.pool.numNodes != numNodes) {
+
+		Embree.pool.start(Embree.numThreads, numNodes);
+
+		// The scratch memory is placed on the workers' nodes when reserved again
+		for (Embree::Scratch& scratch : Embree.scratch)
+			numaFree(scratch.memory);
+		Embree.scratch.clear();
+
+	}
+
+	for (Scene* scene : scenes)
+		scene->embreeReplicateHitDecode(Embree.pool.getNumNodes(), Embree.enableNumaReplication);
+
+}
+
+// Returns the widest packet the CPU and OS support: 16 with AVX-512, 8 with AVX, otherwise 4
+int RayEngine::embreeDetectPacketWidth() {
+
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	// AVX, and the OS saves the YMM registers
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx)
+		return 4;
+
+	unsigned long long xcr0 = _xgetbv(0);
+	if ((xcr0 & 0x6) != 0x6)
+		return 4;
+
+	// AVX-512F, and the OS saves the opmask and ZMM registers
+	if (maxLeaf >= 7) {
+		__cpuidex(info, 7, 0);
+		bool avx512f = (info[1] & (1 << 16)) != 0;
+		if (avx512f && (xcr0 & 0xE6) == 0xE6)
+			return 16;
+	}
+
+	return 8;
+
+}
+
+// Fills the packet kernel table with the instantiations for every width
+void RayEngine::embreeInitPacketKernels() {
+
+	Embree.packetKernels[0] = {
+		&RayEngine::embreeRenderFirePrimaryPacket<4>,
+		&RayEngine::embreeRenderWavefrontIntersect<4>,
+		&RayEngine::embreeRenderWavefrontOccluded<4>,
+		&RayEngine::embreeRenderWavefrontShadows<4>,
+		&RayEngine::embreeRenderTraceAo<4>
+	};
+	Embree.packetKernels[1] = {
+		&RayEngine::embreeRenderFirePrimaryPacket<8>,
+		&RayEngine::embreeRenderWavefrontIntersect<8>,
+		&RayEngine::embreeRenderWavefrontOccluded<8>,
+		&RayEngine::embreeRenderWavefrontShadows<8>,
+		&RayEngine::embreeRenderTraceAo<8>
+	};
+	Embree.packetKernels[2] = {
+		&RayEngine::embreeRenderFirePrimaryPacket<16>,
+		&RayEngine::embreeRenderWavefrontIntersect<16>,
+		&RayEngine::embreeRenderWavefrontOccluded<16>,
+		&RayEngine::embreeRenderWavefrontShadows<16>,
+		&RayEngine::embreeRenderTraceAo<16>
+	};
+
+}
+
+void Scene::embreeInit(RTCDevice device, WorkerPool& pool) {
 
 	Embree.scene = rtcDeviceNewScene(device, EMBREE_SFLAGS_SCENE, EMBREE_AFLAGS_SCENE);
+	Embree.hasSpecular = false;
 
 	for (uint i = 0; i < objects.size(); i++) {
 
-		objects[i]->embreeInit(device);
+		objects[i]->embreeInit(device, pool);
 		uint instID = rtcNewInstance2(Embree.scene, objects[i]->Embree.scene);
 		rtcSetTransform2(Embree.scene, instID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, objects[i]->matrix.e);
 		Embree.instIDmap[instID] = objects[i];
 
+		for (Geometry* geometry : objects[i]->geometries)
+			if (geometry->material->shineExponent > 0.f)
+				Embree.hasSpecular = true;
+
+	}
+
+	// Build hit decode table
+	Embree.hitDecodeStart.assign(Embree.instIDmap.empty() ? 0 : Embree.instIDmap.rbegin()->first + 1, 0);
+	for (auto& inst : Embree.instIDmap) {
+
+		Object* obj = inst.second;
+		uint start = Embree.hitDecode.size();
+		Embree.hitDecodeStart[inst.first] = start;
+		if (!obj->Embree.geomIDmap.empty())
+			Embree.hitDecode.resize(start + obj->Embree.geomIDmap.rbegin()->first + 1);
+
+		for (auto& geom : obj->Embree.geomIDmap) {
+
+			EmbreeHitDecode& decode = Embree.hitDecode[start + geom.first];
+			TriangleMesh* mesh = (TriangleMesh*)geom.second;
+			const float* e = obj->matrix.e;
+			decode.obj = obj;
+			decode.mesh = mesh;
+			decode.normalData = mesh->normalData.empty() ? nullptr : &mesh->normalData[0];
+			decode.texCoordData = mesh->texCoordData.empty() ? nullptr : &mesh->texCoordData[0];
+			decode.indexData = mesh->indexData.empty() ? nullptr : &mesh->indexData[0];
+			decode.normalMatrix[0] = e[0]; decode.normalMatrix[1] = e[4]; decode.normalMatrix[2] = e[8];
+			decode.normalMatrix[3] = e[1]; decode.normalMatrix[4] = e[5]; decode.normalMatrix[5] = e[9];
+			decode.normalMatrix[6] = e[2]; decode.normalMatrix[7] = e[6]; decode.normalMatrix[8] = e[10];
+			decode.material = mesh->material;
+			decode.image = mesh->material->image;
+			decode.ambient = mesh->material->ambient;
+			decode.diffuse = mesh->material->diffuse;
+			decode.specular = mesh->material->specular;
+			decode.shineExponent = mesh->material->shineExponent;
+			decode.reflectIntensity = mesh->material->reflectIntensity;
+			decode.refractIndex = mesh->material->refractIndex;
+
+		}
+
 	}
 
-	rtcCommit(Embree.scene);
+	embreeCommit(Embree.scene, pool);
+
+}
+
+// Points every node at the hit decode table, or at a copy allocated on the node
+void Scene::embreeReplicateHitDecode(int numNodes, bool replicate) {
+
+	for (EmbreeHitDecode* table : Embree.hitDecodeNodes)
+		if (table != Embree.hitDecode.data())
+			numaFree(table);
+
+	Embree.hitDecodeNodes.assign(numNodes, Embree.hitDecode.data());
+
+	if (!replicate || Embree.hitDecode.empty())
+		return;
+
+	size_t size = Embree.hitDecode.size() * sizeof(EmbreeHitDecode);
+	for (int n = 1; n < numNodes; n++) {
+		Embree.hitDecodeNodes[n] = (EmbreeHitDecode*)numaAlloc(size, n);
+		memcpy(Embree.hitDecodeNodes[n], Embree.hitDecode.data(), size);
+	}
 
 }
 
-void Object::embreeInit(RTCDevice device) {
+void Object::embreeInit(RTCDevice device, WorkerPool& pool) {
 
 	Embree.scene = rtcDeviceNewScene(device, EMBREE_SFLAGS_OBJECT, EMBREE_AFLAGS_OBJECT);
 
@@ -52,14 +259,18 @@ void Object::embreeInit(RTCDevice device) {
 		uint geomID = geometries[i]->embreeInit(Embree.scene);
 		Embree.geomIDmap[geomID] = geometries[i];
 
-		// Set filter functions
-		rtcSetOcclusionFilterFunction(Embree.scene, geomID, (RTCFilterFunc)&RayEngine::embreeOcclusionFilter);
-		rtcSetOcclusionFilterFunction8(Embree.scene, geomID, (RTCFilterFunc8)&RayEngine::embreeOcclusionFilter8);
-		rtcSetUserData(Embree.scene, geomID, userData);
+		// Set filter functions, opaque geometry stops light rays without them
+		if (geometries[i]->material->getOpacity() != OP_OPAQUE) {
+			rtcSetOcclusionFilterFunction(Embree.scene, geomID, (RTCFilterFunc)&RayEngine::embreeOcclusionFilter);
+			rtcSetOcclusionFilterFunction4(Embree.scene, geomID, (RTCFilterFunc4)&RayEngine::embreeOcclusionFilterPacket<4>);
+			rtcSetOcclusionFilterFunction8(Embree.scene, geomID, (RTCFilterFunc8)&RayEngine::embreeOcclusionFilterPacket<8>);
+			rtcSetOcclusionFilterFunction16(Embree.scene, geomID, (RTCFilterFunc16)&RayEngine::embreeOcclusionFilterPacket<16>);
+			rtcSetUserData(Embree.scene, geomID, userData);
+		}
 
 	}
 
-	rtcCommit(Embree.scene);
+	embreeCommit(Embree.scene, pool);
 
 }
 
@@ -94,10 +305,7 @@ void RayEngine::embreeUpdatePartition() {
 
 void RayEngine::embreeResize() {
 
-	// Resize buffer
-	Embree.buffer.resize(window.width * window.height);
-
-	// Resize texture
+	// Resize texture, the buffer is allocated with the tile layout before rendering
 	glBindTexture(GL_TEXTURE_2D, Embree.texture);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, window.width, window.height, 0, GL_RGBA, GL_FLOAT, 0);
 	glBindTexture(GL_TEXTURE_2D, 0);
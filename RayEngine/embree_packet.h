@@ -0,0 +1,53 @@
+#pragma once
+
+#include <embree2/rtcore.h>
+#include <embree2/rtcore_ray.h>
+
+// Maps a packet width to its Embree ray type and packet calls
+template<int N>
+struct EmbreePacket;
+
+template<>
+struct EmbreePacket<4> {
+
+	typedef RTCRay4 Ray;
+
+	static __forceinline void intersect(const void* valid, RTCScene scene, RTCRay4& ray) {
+		rtcIntersect4(valid, scene, ray);
+	}
+
+	static __forceinline void occluded(const void* valid, RTCScene scene, RTCRay4& ray) {
+		rtcOccluded4(valid, scene, ray);
+	}
+
+};
+
+template<>
+struct EmbreePacket<8> {
+
+	typedef RTCRay8 Ray;
+
+	static __forceinline void intersect(const void* valid, RTCScene scene, RTCRay8& ray) {
+		rtcIntersect8(valid, scene, ray);
+	}
+
+	static __forceinline void occluded(const void* valid, RTCScene scene, RTCRay8& ray) {
+		rtcOccluded8(valid, scene, ray);
+	}
+
+};
+
+template<>
+struct EmbreePacket<16> {
+
+	typedef RTCRay16 Ray;
+
+	static __forceinline void intersect(const void* valid, RTCScene scene, RTCRay16& ray) {
+		rtcIntersect16(valid, scene, ray);
+	}
+
+	static __forceinline void occluded(const void* valid, RTCScene scene, RTCRay16& ray) {
+		rtcOccluded16(valid, scene, ray);
+	}
+
+};
@@ -1,92 +1,726 @@
 #include "rayengine.h"
-#include <omp.h>
 
-void RayEngine::embreeRender() {
+// Renders a frame into the buffer and resolves it into the image. Everything the
+// threads read about the frame is in Embree.frame for the duration.
+void RayEngine::embreeRender(const FrameState& frame) {
 
 	if (renderMode == RM_HYBRID && !Hybrid.enableEmbree)
 		return;
 
+	Embree.frame = frame;
 	Embree.renderTimer.start();
+	double deadline = WorkerPool::getSeconds() + Embree.frame.budgetMs * 0.001;
+	bool budget = (Embree.frame.enableTiles && Embree.frame.enableBudget);
+
+	if (Embree.frame.embreeWidth > 0) {
+
+		embreeUpdateTileLayout();
+
+		// Checkerboard frames alternate the parity of the traced pixels, also when the render thread
+		// skips frames of the loop. The last frame's pixels are only used by a later frame of the same size.
+		if (Embree.frame.enableCheckerboard) {
+			const FrameState& last = Embree.checkerFrame;
+			Embree.frame.checkerParity = last.checkerParity ^ 1;
+			Embree.checkerHistory = Embree.frame.number > 1 && last.number < Embree.frame.number &&
+				last.enableCheckerboard && last.scene == Embree.frame.scene &&
+				last.width == Embree.frame.width && last.height == Embree.frame.height &&
+				last.embreeOffset == Embree.frame.embreeOffset && last.embreeWidth == Embree.frame.embreeWidth;
+			Embree.checkerStep = 2;
+			Embree.checkerInfo.resize(Embree.frame.width * Embree.frame.height);
+		} else
+			Embree.checkerStep = 1;
+
+		// Clear the buffer from the nodes holding it. With a budget or checkerboard it's kept so that
+		// skipped tasks and untraced pixels show the last frame, and the wavefront clears the pixels it
+		// renders instead.
+		if (!budget && !Embree.frame.enableCheckerboard) {
+			if (Embree.tiledBuffer) {
+				int tileSize = 1 << (Embree.tileShiftX + Embree.tileShiftY);
+				Embree.pool.run(Embree.bufferTilesX * Embree.bufferTilesY, [&](int t) {
+					fill(&Embree.buffer[t * tileSize], &Embree.buffer[t * tileSize] + tileSize, 0.f);
+				}, false, [&](int t) { return embreeRowNode((t / Embree.bufferTilesX) << Embree.tileShiftY); });
+			} else {
+				Embree.pool.run(Embree.frame.height, [&](int y) {
+					fill(&Embree.buffer[y * Embree.frame.width], &Embree.buffer[y * Embree.frame.width] + Embree.frame.width, 0.f);
+				}, false, [&](int y) { return embreeRowNode(y); });
+			}
+		}
 
-	if (Embree.width > 0) {
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST); // TODO: Find out if this does anything
 
-		fill(begin(Embree.buffer), end(Embree.buffer), 0.f);
+		// One set of wavefront queues per thread
+		if (Embree.frame.enableWavefront && (int)Embree.wavefronts.size() < Embree.pool.getNumWorkers())
+			Embree.wavefronts.resize(Embree.pool.getNumWorkers());
 
-		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST); // TODO: Find out if this does anything
+		Embree.threadCounters.assign(Embree.pool.getNumWorkers(), { 0, 0, 0, 0, 0, 0 });
+
+		// The AO cache holds the cells of one scene and cell size
+		if (Embree.frame.enableAo && Embree.frame.enableAoCache && (!Embree.aoCache.cells || Embree.aoCacheScene != Embree.frame.scene || Embree.aoCache.cellSize != Embree.frame.aoCacheCell)) {
+			if (!Embree.aoCache.cells)
+				Embree.aoCache.resize(AO_CACHE_CELLS);
+			Embree.aoCache.clear(Embree.frame.aoCacheCell);
+			Embree.aoCacheScene = Embree.frame.scene;
+		}
+
+		// The cache of the last frame is reused by a later frame of the same scene and settings
+		if (Embree.frame.enableCache) {
+			Embree.cacheReuse = Embree.frame.number > 1 && Embree.cacheFrame.number < Embree.frame.number &&
+				Embree.cacheFrame.scene == Embree.frame.scene && (int)Embree.cache.size() == Embree.cacheFrame.width * Embree.cacheFrame.height;
+			Embree.nextCache.resize(Embree.frame.width * Embree.frame.height);
+		}
+
+		// Packet tracing state of the recursion
+		if (Embree.frame.enablePacketsPrimary && Embree.frame.enablePacketsSecondary && !Embree.frame.enableWavefront)
+			embreeReserveScratch();
 	
-		if (Embree.enableTiles) {
+		if (Embree.frame.enableTiles) {
 
-			int numTilesX = ceil((float)Embree.width / Embree.tileWidth);
-			int numTilesY = ceil((float)window.height / Embree.tileHeight);
-			int numTiles = numTilesX * numTilesY;
+			embreeScheduleTiles();
+			atomic<int> skippedTiles(0);
 
-			#pragma omp parallel for schedule(dynamic)
-			for (int t = 0; t < numTiles; t++) {
+			Embree.pool.run(Embree.tileTasks.size(), [&](int t) {
+
+				Embree::TileTask& task = Embree.tileTasks[t];
+				double taskStart = WorkerPool::getSeconds();
+
+				// Skip the tasks predicted to end after the budget, their cost is kept for the next frame
+				if (budget && taskStart + task.predictedCost > deadline) {
+					task.skipped = true;
+					task.cost = task.predictedCost;
+					skippedTiles++;
+					return;
+				}
 
-				int tileX = t % numTilesX;
-				int tileY = t / numTilesX;
+				if (Embree.frame.enableWavefront) {
 
-				int x0 = tileX * Embree.tileWidth;
-				int x1 = min(x0 + Embree.tileWidth, Embree.width);
-				int y0 = tileY * Embree.tileHeight;
-				int y1 = min(y0 + Embree.tileHeight, window.height);
+					if (budget || Embree.frame.enableCheckerboard)
+						embreeClearArea(task.x0, task.y0, task.x1, task.y1);
+					embreeRenderWavefront(task.x0, task.y0, task.x1, task.y1);
 
-				if (Embree.enablePacketsPrimary) {
+				} else if (Embree.frame.enablePacketsPrimary) {
 
-					for (int y = y0; y < y1; y++)
-						for (int x = x0; x < x1; x += EMBREE_PACKET_SIZE)
-							embreeRenderFirePrimaryPacket(x, y);
+					for (int y = task.y0; y < task.y1; y++)
+						for (int x = embreeCheckerStart(task.x0, y); x < task.x1; x += Embree.frame.packetWidth * Embree.checkerStep)
+							(this->*embreePacketKernels().firePrimaryPacket)(x, y, task.x1);
 
 				} else {
 
-					for (int y = y0; y < y1; y++)
-						for (int x = x0; x < x1; x++)
+					for (int y = task.y0; y < task.y1; y++)
+						for (int x = embreeCheckerStart(task.x0, y); x < task.x1; x += Embree.checkerStep)
 							embreeRenderFirePrimaryRay(x, y);
 
 				}
 
-			}
+				task.cost = WorkerPool::getSeconds() - taskStart;
+
+			}, Embree.frame.enableCostScheduling || budget, [&](int t) { return embreeRowNode(Embree.tileTasks[t].y0); });
+
+			Embree.skippedTiles = skippedTiles;
+			embreeUpdateTileCosts();
+			Embree.costTilesX = Embree.orderTilesX;
+			Embree.costTilesY = Embree.orderTilesY;
+			Embree.costXaxis = Embree.frame.rayXaxis;
+			Embree.costYaxis = Embree.frame.rayYaxis;
+			Embree.costZaxis = Embree.frame.rayZaxis;
 
 		} else {
 
-			if (Embree.enablePacketsPrimary) {
+			if (Embree.frame.enableWavefront) {
 
-				#pragma omp parallel for schedule(dynamic)
-				for (int y = 0; y < window.height; y++)
-					for (int x = 0; x < Embree.width; x += EMBREE_PACKET_SIZE)
-						embreeRenderFirePrimaryPacket(x, y);
+				Embree.pool.run(Embree.frame.height, [&](int y) {
+					if (Embree.frame.enableCheckerboard)
+						embreeClearArea(0, y, Embree.frame.embreeWidth, y + 1);
+					embreeRenderWavefront(0, y, Embree.frame.embreeWidth, y + 1);
+				}, false, [&](int y) { return embreeRowNode(y); });
+
+			} else if (Embree.frame.enablePacketsPrimary) {
+
+				Embree.pool.run(Embree.frame.height, [&](int y) {
+					for (int x = embreeCheckerStart(0, y); x < Embree.frame.embreeWidth; x += Embree.frame.packetWidth * Embree.checkerStep)
+						(this->*embreePacketKernels().firePrimaryPacket)(x, y, Embree.frame.embreeWidth);
+				}, false, [&](int y) { return embreeRowNode(y); });
 
 			} else {
 
-				#pragma omp parallel for schedule(dynamic)
-				for (int y = 0; y < window.height; y++)
-					for (int x = 0; x < Embree.width; x++)
+				Embree.pool.run(Embree.frame.height, [&](int y) {
+					for (int x = embreeCheckerStart(0, y); x < Embree.frame.embreeWidth; x += Embree.checkerStep)
 						embreeRenderFirePrimaryRay(x, y);
+				}, false, [&](int y) { return embreeRowNode(y); });
 
 			}
 
 		}
 
+		Embree.tailTime = Embree.pool.lastTailTime;
+		Embree.idleTime = Embree.pool.lastIdleTime;
+		Embree.steals = Embree.pool.lastSteals;
+
+		Embree.filterCalls = Embree.shadedHits = 0;
+		uint aoHits = 0, aoSamples = 0, cacheLookups = 0, cacheHits = 0;
+		for (Embree::ThreadCounter& counter : Embree.threadCounters) {
+			Embree.filterCalls += counter.filterCalls;
+			Embree.shadedHits += counter.shadedHits;
+			aoHits += counter.aoHits;
+			aoSamples += counter.aoSamples;
+			cacheLookups += counter.cacheLookups;
+			cacheHits += counter.cacheHits;
+		}
+		Embree.aoSamplesPerHit = aoHits ? (float)aoSamples / aoHits : 0.f;
+		Embree.cacheHitRate = cacheLookups ? (float)cacheHits / cacheLookups : 0.f;
+
+		if (Embree.frame.enableCache) {
+			Embree.cache.swap(Embree.nextCache);
+			Embree.cacheFrame = Embree.frame;
+		}
+
 	}
 
 	Embree.renderTimer.stop();
 
+	if (Embree.frame.embreeWidth > 0)
+		embreeResolveImage();
+
+	Embree.checkerFrame = Embree.frame;
+
+}
+
+// Makes the last rendered frame the displayed one. Must not run while the displayed image is uploaded.
+void RayEngine::embreeRenderPresent() {
+
+	if (renderMode == RM_HYBRID && !Hybrid.enableEmbree)
+		return;
+
+	Embree.image.swap(Embree.displayImage);
+	Embree.displayFrame = Embree.frame;
+	embreeCollectStats(Embree.displayStats);
+	Embree.displayUploaded = false;
+	embreeUpdateScale();
+
+}
+
+// Picks the scale of the next frames from the displayed one. Its render time per pixel is blended
+// into a running average, which gives the scale whose pixels would take the target time. The scale
+// only follows once it's EMBREE_SCALE_HYSTERESIS away (or at a limit), so it doesn't flicker.
+void RayEngine::embreeUpdateScale() {
+
+	if (renderMode != RM_EMBREE || !Embree.enableDynamicResolution)
+		return;
+
+	float pixels = (float)Embree.displayFrame.width * Embree.displayFrame.height;
+	if (Embree.displayStats.renderTime <= 0.f)
+		return;
+
+	float pixelCost = Embree.displayStats.renderTime / pixels;
+	Embree.pixelCost = (Embree.pixelCost > 0.f) ? Embree.pixelCost + (pixelCost - Embree.pixelCost) * EMBREE_SCALE_BLEND : pixelCost;
+
+	float targetPixels = Embree.targetMs * 0.001f / Embree.pixelCost;
+	float scale = clamp(sqrt(targetPixels / ((float)window.width * window.height)), EMBREE_MIN_SCALE, 1.f);
+	if (fabs(scale - Embree.scale) > EMBREE_SCALE_HYSTERESIS || scale == 1.f || scale == EMBREE_MIN_SCALE)
+		Embree.scale = scale;
+
+}
+
+// Stretches a scaled image to the window with a bilinear filter in two passes on the pool: every
+// row is widened into upscaleRows, which are then blended down each column back into the image
+void RayEngine::embreeUpscaleImage() {
+
+	int srcWidth = Embree.frame.width, srcHeight = Embree.frame.height;
+	int width = Embree.frame.windowWidth, height = Embree.frame.windowHeight;
+	if (srcWidth == width && srcHeight == height)
+		return;
+
+	// Source pixels and weight of every column, with the pixel centers aligned. Only rebuilt when
+	// the scale or the window changes.
+	if (srcWidth != Embree.upscaleSrcWidth || srcHeight != Embree.upscaleSrcHeight || width != Embree.upscaleWidth) {
+		Embree.upscaleSrcWidth = srcWidth;
+		Embree.upscaleSrcHeight = srcHeight;
+		Embree.upscaleWidth = width;
+		Embree.upscaleRows.resize(srcHeight * width);
+		Embree.upscaleColumns.resize(width);
+		Embree.upscaleColumnWeights.resize(width);
+		for (int x = 0; x < width; x++) {
+			float sx = max((x + 0.5f) * srcWidth / width - 0.5f, 0.f);
+			Embree.upscaleColumns[x] = min((int)sx, srcWidth - 1);
+			Embree.upscaleColumnWeights[x] = sx - Embree.upscaleColumns[x];
+		}
+	}
+
+	Embree.pool.run(srcHeight, [&](int y) {
+		const Color* src = &Embree.image[y * srcWidth];
+		Color* dst = &Embree.upscaleRows[y * width];
+		for (int x = 0; x < width; x++) {
+			int x0 = Embree.upscaleColumns[x], x1 = min(x0 + 1, srcWidth - 1);
+			float weight = Embree.upscaleColumnWeights[x];
+			dst[x] = src[x0] * (1.f - weight) + src[x1] * weight;
+		}
+	});
+
+	// The rows hold all of the source now, so the image is grown in place
+	Embree.image.resize(width * height);
+
+	Embree.pool.run(height, [&](int y) {
+		float sy = max((y + 0.5f) * srcHeight / height - 0.5f, 0.f);
+		int y0 = min((int)sy, srcHeight - 1), y1 = min(y0 + 1, srcHeight - 1);
+		float weight = sy - y0;
+		const Color* row0 = &Embree.upscaleRows[y0 * width];
+		const Color* row1 = &Embree.upscaleRows[y1 * width];
+		Color* dst = &Embree.image[y * width];
+		for (int x = 0; x < width; x++)
+			dst[x] = row0[x] * (1.f - weight) + row1[x] * weight;
+	});
+
 }
 
+// Uploads the displayed image if it's new, and draws it. Only reads displayImage and displayFrame,
+// so the next frame can be rendered meanwhile.
 void RayEngine::embreeRenderUpdateTexture() {
 
 	if (renderMode == RM_HYBRID && !Hybrid.enableEmbree)
 		return;
 
+	// The image of a frame from before a resize is dropped. Scaled frames were already upscaled to
+	// the window they were rendered for.
+	const FrameState& frame = Embree.displayFrame;
+	if (frame.windowWidth != window.width || frame.windowHeight != window.height ||
+		Embree.displayImage.size() != (size_t)window.width * window.height)
+		return;
+
 	Embree.textureTimer.start();
 
-	glBindTexture(GL_TEXTURE_2D, Embree.texture);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, window.width, window.height, GL_RGBA, GL_FLOAT, &Embree.buffer[0]);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	if (!Embree.displayUploaded) {
+		glBindTexture(GL_TEXTURE_2D, Embree.texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, window.width, window.height, GL_RGBA, GL_FLOAT, &Embree.displayImage[0]);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		Embree.displayUploaded = true;
+	}
 
 	//glDrawPixels(Embree.width, window.height, GL_RGBA, GL_FLOAT, &Embree.buffer[0]);
 	OpenGL.shdrTexture->render2DBox(window.ortho, Embree.offset, 0, window.width, window.height, Embree.texture, (renderMode == RM_HYBRID && Hybrid.displayPartition) ? EMBREE_HIGHLIGHT_COLOR : Color(1.f));
 
 	Embree.textureTimer.stop();
 
+}
+
+// Sets up the buffer layout and tile order for the tile size, window and partition. The buffer is
+// split into one band of rows per NUMA node, see embreeRowNode.
+void RayEngine::embreeUpdateTileLayout() {
+
+	Embree.tiledBuffer = Embree.frame.enableTiles;
+	int numNodes = Embree.pool.getNumNodes();
+	vector<size_t> bandStarts(numNodes);
+
+	if (Embree.tiledBuffer) {
+
+		Embree.tileShiftX = (int)log2(Embree.frame.tileWidth);
+		Embree.tileShiftY = (int)log2(Embree.frame.tileHeight);
+		Embree.bufferTilesX = (Embree.frame.width + Embree.frame.tileWidth - 1) >> Embree.tileShiftX;
+		Embree.bufferTilesY = (Embree.frame.height + Embree.frame.tileHeight - 1) >> Embree.tileShiftY;
+		for (int n = 0; n < numNodes; n++)
+			bandStarts[n] = (size_t)(((n * Embree.bufferTilesY + numNodes - 1) / numNodes) * Embree.bufferTilesX) << (Embree.tileShiftX + Embree.tileShiftY);
+		Embree.buffer.resize((Embree.bufferTilesX * Embree.bufferTilesY) << (Embree.tileShiftX + Embree.tileShiftY), bandStarts);
+
+		// Order the tiles of the partition along a Morton curve, so that consecutive tiles
+		// (and the blocks of tiles handed to each thread) cover compact areas of the screen
+		int tilesX = (Embree.frame.embreeWidth + Embree.frame.tileWidth - 1) >> Embree.tileShiftX;
+		int tilesY = Embree.bufferTilesY;
+
+		if (tilesX != Embree.orderTilesX || tilesY != Embree.orderTilesY) {
+
+			Embree.orderTilesX = tilesX;
+			Embree.orderTilesY = tilesY;
+			Embree.tileOrder.clear();
+
+			uint side = 1;
+			while (side < (uint)max(tilesX, tilesY))
+				side *= 2;
+
+			for (uint m = 0; m < side * side; m++) {
+
+				uint x = 0, y = 0;
+				for (uint b = 0; (1u << b) < side; b++) {
+					x |= ((m >> (2 * b)) & 1) << b;
+					y |= ((m >> (2 * b + 1)) & 1) << b;
+				}
+
+				if ((int)x < tilesX && (int)y < tilesY)
+					Embree.tileOrder.push_back(y * tilesX + x);
+
+			}
+
+		}
+
+	} else {
+
+		for (int n = 0; n < numNodes; n++)
+			bandStarts[n] = (size_t)((n * Embree.frame.height + numNodes - 1) / numNodes) * Embree.frame.width;
+		Embree.buffer.resize(Embree.frame.width * Embree.frame.height, bandStarts);
+
+	}
+
+}
+
+// Builds the tasks of the frame from the tiles of the partition. A tile is predicted to cost
+// what the tile showing the same direction did in the last frame, found by reprojecting its
+// center with the last camera axes. With cost scheduling the tasks are ordered most expensive
+// first, so that no expensive tile is left to stretch the end of the frame.
+void RayEngine::embreeScheduleTiles() {
+
+	int numTiles = Embree.tileOrder.size();
+	bool history = (Embree.costTilesX == Embree.orderTilesX && Embree.costTilesY == Embree.orderTilesY);
+
+	if (!history) {
+		Embree.tileCosts.assign(numTiles, 0.f);
+		Embree.tileCostAverages.assign(numTiles, 0.f);
+	}
+
+	float averageCost = 0.f, averageCostAverage = 0.f;
+	for (int t = 0; t < numTiles; t++) {
+		averageCost += Embree.tileCosts[t];
+		averageCostAverage += Embree.tileCostAverages[t];
+	}
+	averageCost /= numTiles;
+	averageCostAverage /= numTiles;
+
+	Embree.tilePredictedCosts = Embree.tileCostAverages;
+
+	if (history && (Embree.frame.enableCostScheduling || Embree.frame.enableBudget)) {
+
+		float xLengthSqr = Vec3::dot(Embree.costXaxis, Embree.costXaxis);
+		float yLengthSqr = Vec3::dot(Embree.costYaxis, Embree.costYaxis);
+
+		for (int t = 0; t < numTiles; t++) {
+
+			// Direction through the tile center
+			int cx = min((t % Embree.orderTilesX) * Embree.frame.tileWidth + Embree.frame.tileWidth / 2, Embree.frame.embreeWidth - 1);
+			int cy = min((t / Embree.orderTilesX) * Embree.frame.tileHeight + Embree.frame.tileHeight / 2, Embree.frame.height - 1);
+			float dx = ((float)(Embree.frame.embreeOffset + cx) / Embree.frame.width) * 2.f - 1.f;
+			float dy = ((float)cy / Embree.frame.height) * 2.f - 1.f;
+			Vec3 dir = dx * Embree.frame.rayXaxis + dy * Embree.frame.rayYaxis + Embree.frame.rayZaxis;
+
+			// Project into the last frame
+			float cost = averageCost;
+			float depth = Vec3::dot(dir, Embree.costZaxis);
+			if (depth > 0.f) {
+
+				Vec3 p = dir * (1.f / depth);
+				float px = ((Vec3::dot(p, Embree.costXaxis) / xLengthSqr + 1.f) * 0.5f) * Embree.frame.width - Embree.frame.embreeOffset;
+				float py = ((Vec3::dot(p, Embree.costYaxis) / yLengthSqr + 1.f) * 0.5f) * Embree.frame.height;
+
+				if (px >= 0.f && px < Embree.frame.embreeWidth && py >= 0.f && py < Embree.frame.height)
+					cost = Embree.tileCosts[((int)py / Embree.frame.tileHeight) * Embree.orderTilesX + (int)px / Embree.frame.tileWidth];
+
+			}
+
+			Embree.tilePredictedCosts[t] = cost;
+
+		}
+
+	}
+
+	Embree.tileTasks.clear();
+
+	// Adaptive tiles are decided by the cost averages, which change slower than the
+	// per-frame costs so the tiling doesn't flicker
+	bool adaptive = (Embree.frame.enableAdaptiveTiles && history && averageCostAverage > 0.f);
+	vector<bool> covered(numTiles, false);
+
+	for (int tile : Embree.tileOrder) {
+
+		if (covered[tile])
+			continue;
+
+		int tileX = tile % Embree.orderTilesX;
+		int tileY = tile / Embree.orderTilesX;
+		int size = 1;
+
+		// Merge the largest aligned block starting at this tile that costs no more than an average tile.
+		// The Morton order visits the tiles of such a block in a row, starting at its corner.
+		for (int s = adaptive ? EMBREE_ADAPTIVE_MERGE : 1; s > 1; s /= 2) {
+
+			if ((tileX & (s - 1)) || (tileY & (s - 1)))
+				continue;
+
+			float blockCost = 0.f;
+			for (int y = tileY; y < min(tileY + s, Embree.orderTilesY); y++)
+				for (int x = tileX; x < min(tileX + s, Embree.orderTilesX); x++)
+					blockCost += Embree.tileCostAverages[y * Embree.orderTilesX + x];
+
+			if (blockCost <= averageCostAverage) {
+				size = s;
+				break;
+			}
+
+		}
+
+		int x1 = min(tileX + size, Embree.orderTilesX);
+		int y1 = min(tileY + size, Embree.orderTilesY);
+		float predictedCost = 0.f;
+		for (int y = tileY; y < y1; y++) {
+			for (int x = tileX; x < x1; x++) {
+				covered[y * Embree.orderTilesX + x] = true;
+				predictedCost += Embree.tilePredictedCosts[y * Embree.orderTilesX + x];
+			}
+		}
+
+		// Expensive tiles are split down to pieces near the average cost
+		float splitCost = Embree.tileCostAverages[tile] > EMBREE_ADAPTIVE_SPLIT * averageCostAverage ? averageCostAverage : 0.f;
+		if (!adaptive || size > 1)
+			splitCost = 0.f;
+
+		embreeAddTileTask(tileX * Embree.frame.tileWidth, tileY * Embree.frame.tileHeight,
+						  min(x1 * Embree.frame.tileWidth, Embree.frame.embreeWidth), min(y1 * Embree.frame.tileHeight, Embree.frame.height),
+						  predictedCost, splitCost);
+
+	}
+
+	if (Embree.frame.enableBudget) {
+
+		// Nearest the focus first, so what runs out of budget is the edge of the view
+		float focusX = Embree.frame.focusX - Embree.frame.embreeOffset, focusY = Embree.frame.focusY;
+		auto distance = [focusX, focusY](const Embree::TileTask& task) {
+			float dx = (task.x0 + task.x1) * 0.5f - focusX;
+			float dy = (task.y0 + task.y1) * 0.5f - focusY;
+			return dx * dx + dy * dy;
+		};
+		stable_sort(Embree.tileTasks.begin(), Embree.tileTasks.end(), [&](const Embree::TileTask& a, const Embree::TileTask& b) {
+			return distance(a) < distance(b);
+		});
+
+	} else if (Embree.frame.enableCostScheduling && history) {
+		stable_sort(Embree.tileTasks.begin(), Embree.tileTasks.end(), [](const Embree::TileTask& a, const Embree::TileTask& b) {
+			return a.predictedCost > b.predictedCost;
+		});
+	}
+
+}
+
+// Adds a task for an area, halving it while its part of the cost is above splitCost. The pieces
+// keep at least a packet of pixels per row, and the left ones a whole number of packets.
+void RayEngine::embreeAddTileTask(int x0, int y0, int x1, int y1, float cost, float splitCost) {
+
+	int width = x1 - x0;
+	int height = y1 - y0;
+
+	if (splitCost > 0.f && cost > splitCost) {
+
+		if (width >= Embree.frame.packetWidth * 2 && width > height) {
+			int xm = x0 + ((width / 2) & ~(Embree.frame.packetWidth - 1));
+			embreeAddTileTask(x0, y0, xm, y1, cost * (xm - x0) / width, splitCost);
+			embreeAddTileTask(xm, y0, x1, y1, cost * (x1 - xm) / width, splitCost);
+			return;
+		}
+
+		if (height >= 2) {
+			int ym = y0 + height / 2;
+			embreeAddTileTask(x0, y0, x1, ym, cost * (ym - y0) / height, splitCost);
+			embreeAddTileTask(x0, ym, x1, y1, cost * (y1 - ym) / height, splitCost);
+			return;
+		}
+
+	}
+
+	Embree.tileTasks.push_back({ x0, y0, x1, y1, cost, 0.f, false });
+
+}
+
+// Zeroes the pixels of an area traced this frame before they're accumulated into
+void RayEngine::embreeClearArea(int x0, int y0, int x1, int y1) {
+
+	for (int y = y0; y < y1; y++)
+		for (int x = embreeCheckerStart(x0, y); x < x1; x += Embree.checkerStep)
+			Embree.buffer[embreeBufferIndex(x, y)] = Color(0.f);
+
+}
+
+// Spreads the measured time of every task over the tiles it covered, and blends it into the averages
+void RayEngine::embreeUpdateTileCosts() {
+
+	fill(Embree.tileCosts.begin(), Embree.tileCosts.end(), 0.f);
+
+	for (const Embree::TileTask& task : Embree.tileTasks) {
+
+		float costPerPixel = task.cost / ((task.x1 - task.x0) * (task.y1 - task.y0));
+
+		for (int ty = task.y0 / Embree.frame.tileHeight; ty * Embree.frame.tileHeight < task.y1; ty++) {
+			for (int tx = task.x0 / Embree.frame.tileWidth; tx * Embree.frame.tileWidth < task.x1; tx++) {
+				int width = min((tx + 1) * Embree.frame.tileWidth, task.x1) - max(tx * Embree.frame.tileWidth, task.x0);
+				int height = min((ty + 1) * Embree.frame.tileHeight, task.y1) - max(ty * Embree.frame.tileHeight, task.y0);
+				Embree.tileCosts[ty * Embree.orderTilesX + tx] += costPerPixel * width * height;
+			}
+		}
+
+	}
+
+	for (int t = 0; t < (int)Embree.tileCosts.size(); t++) {
+		float& average = Embree.tileCostAverages[t];
+		average = (average > 0.f) ? average + (Embree.tileCosts[t] - average) * EMBREE_COST_BLEND : Embree.tileCosts[t];
+	}
+
+}
+
+// Outlines the tasks of the displayed frame: merged blocks in green, split pieces in red
+// and tasks skipped by the frame budget in blue
+void RayEngine::embreeRenderTileOverlay() {
+
+	// The tasks are in the pixels of the frame, which may be scaled
+	const FrameState& frame = Embree.displayFrame;
+	if (!frame.enableTiles || !Embree.displayTiles)
+		return;
+
+	float toWindow = 1.f / frame.scale;
+
+	for (const Embree::TileTask& task : Embree.displayStats.tileTasks) {
+
+		int width = task.x1 - task.x0;
+		int height = task.y1 - task.y0;
+		int tileWidth = min(frame.tileWidth, frame.embreeWidth - (task.x0 & ~(frame.tileWidth - 1)));
+		int tileHeight = min(frame.tileHeight, frame.height - (task.y0 & ~(frame.tileHeight - 1)));
+
+		Color color = { 1.f, 1.f, 1.f, 0.25f };
+		if (task.skipped)
+			color = { 0.f, 0.5f, 1.f, 0.5f };
+		else if (width > tileWidth || height > tileHeight)
+			color = { 0.f, 1.f, 0.f, 0.5f };
+		else if (width < tileWidth || height < tileHeight)
+			color = { 1.f, 0.f, 0.f, 0.5f };
+
+		int x = (frame.embreeOffset + task.x0) * toWindow, y = task.y0 * toWindow;
+		OpenGL.shdrColor->render2DBox(window.ortho, x, y, width * toWindow, 1, 0, color);
+		OpenGL.shdrColor->render2DBox(window.ortho, x, y, 1, height * toWindow, 0, color);
+
+	}
+
+}
+
+// Copies the buffer into the image with rows of pixels, detiling it if needed, and upscales it.
+// The copy is a pass of its own rather than part of the upload: the image has to be apart from
+// the buffer anyway, so the next frame can be traced while this one is uploaded, and it's where
+// the frames are accumulated and upscaled. The pool copies every tile from the node holding it,
+// where the upload would gather the tiles on the loop thread. Its time is shown in the GUI and
+// logged by benchmarks next to the render time.
+void RayEngine::embreeResolveImage() {
+
+	Embree.resolveTimer.start();
+	Embree.image.resize(Embree.frame.width * Embree.frame.height);
+
+	if (!Embree.tiledBuffer) {
+
+		Embree.pool.run(Embree.frame.height, [&](int y) {
+			copy(&Embree.buffer[y * Embree.frame.width], &Embree.buffer[y * Embree.frame.width] + Embree.frame.width, &Embree.image[y * Embree.frame.width]);
+		}, false, [&](int y) { return embreeRowNode(y); });
+
+	} else {
+
+		Embree.pool.run(Embree.bufferTilesX * Embree.bufferTilesY, [&](int t) {
+
+			int x0 = (t % Embree.bufferTilesX) * Embree.frame.tileWidth;
+			int y0 = (t / Embree.bufferTilesX) * Embree.frame.tileHeight;
+			int width = min(Embree.frame.tileWidth, Embree.frame.width - x0);
+			int height = min(Embree.frame.tileHeight, Embree.frame.height - y0);
+			Color* tile = &Embree.buffer[t << (Embree.tileShiftX + Embree.tileShiftY)];
+
+			for (int y = 0; y < height; y++)
+				copy(tile + y * Embree.frame.tileWidth, tile + y * Embree.frame.tileWidth + width, &Embree.image[(y0 + y) * Embree.frame.width + x0]);
+
+		}, false, [&](int t) { return embreeRowNode((t / Embree.bufferTilesX) << Embree.tileShiftY); });
+
+	}
+
+	Embree.resolveTimer.stop();
+
+	embreeReconstructCheckerboard();
+	embreeAccumulateImage();
+	embreeUpscaleImage();
+
+}
+
+// Fills in the pixels a checkerboard frame didn't trace, which still hold what the last frame traced
+// there. That color is kept if its primitive is the one a neighbour sees now, at the same depth, so
+// it's the same point of the same triangle. Otherwise the pixel is interpolated from its left and
+// right or upper and lower neighbours, whichever pair is closer in depth, or copied from the nearer
+// one if they're on different surfaces, so that no edge is blurred. The neighbours only need to be
+// on the same mesh to be blended, as neighbouring pixels of one surface often hit other triangles.
+void RayEngine::embreeReconstructCheckerboard() {
+
+	int width = Embree.frame.width, height = Embree.frame.height, embreeWidth = Embree.frame.embreeWidth;
+	Embree.checkerReuse = 0.f;
+	if (!Embree.frame.enableCheckerboard || embreeWidth < 2 || height < 2)
+		return;
+
+	// Misses are all the same sky
+	auto sameSurface = [](const Embree::CheckerPixel& a, const Embree::CheckerPixel& b) {
+		if (a.geomID == RTC_INVALID_GEOMETRY_ID || b.geomID == RTC_INVALID_GEOMETRY_ID)
+			return a.geomID == b.geomID;
+		return a.instID == b.instID && a.geomID == b.geomID && fabs(a.depth - b.depth) <= EMBREE_CHECKER_TOLERANCE * min(a.depth, b.depth);
+	};
+	auto samePoint = [&](const Embree::CheckerPixel& a, const Embree::CheckerPixel& b) {
+		return a.primID == b.primID && sameSurface(a, b);
+	};
+
+	atomic<int> reused(0);
+	Embree.pool.run(height, [&](int y) {
+
+		Color* image = &Embree.image[y * width];
+		const Embree::CheckerPixel* info = &Embree.checkerInfo[y * width];
+		int rowReused = 0;
+
+		for (int x = embreeCheckerStart(0, y) ^ 1; x < embreeWidth; x += 2) {
+
+			// Offsets of the traced neighbours, at the borders the missing one is replaced by the opposite
+			int left = (x > 0) ? x - 1 : x + 1;
+			int right = (x + 1 < embreeWidth) ? x + 1 : x - 1;
+			int up = (y > 0) ? x - width : x + width;
+			int down = (y + 1 < height) ? x + width : x - width;
+
+			if (Embree.checkerHistory && (samePoint(info[x], info[left]) || samePoint(info[x], info[right]) ||
+				samePoint(info[x], info[up]) || samePoint(info[x], info[down]))) {
+				rowReused++;
+				continue;
+			}
+
+			bool horizontal = fabs(info[left].depth - info[right].depth) <= fabs(info[up].depth - info[down].depth);
+			int a = horizontal ? left : up, b = horizontal ? right : down;
+
+			if (sameSurface(info[a], info[b]))
+				image[x] = (image[a] + image[b]) * 0.5f;
+			else
+				image[x] = (info[a].depth <= info[b].depth) ? image[a] : image[b];
+
+		}
+
+		reused += rowReused;
+
+	}, false, [&](int y) { return embreeRowNode(y); });
+
+	int missing = (embreeWidth * height) / 2;
+	Embree.checkerReuse = missing ? (float)reused / missing : 0.f;
+
+}
+
+// Averages the image into the frames of the same view rendered before it, restarting on a new view
+void RayEngine::embreeAccumulateImage() {
+
+	if (Embree.frame.view == 0) {
+		Embree.accumulatedFrames = 0;
+		return;
+	}
+
+	if (Embree.frame.view != Embree.accumulatedView || Embree.accumulation.size() != Embree.image.size()) {
+		Embree.accumulatedView = Embree.frame.view;
+		Embree.accumulatedFrames = 0;
+		Embree.accumulation.resize(Embree.image.size());
+	}
+
+	Embree.accumulatedFrames++;
+	float weight = 1.f / Embree.accumulatedFrames;
+
+	Embree.pool.run(Embree.frame.height, [&](int y) {
+		Color* accumulated = &Embree.accumulation[y * Embree.frame.width];
+		Color* image = &Embree.image[y * Embree.frame.width];
+		for (int x = 0; x < Embree.frame.width; x++) {
+			accumulated[x] = accumulated[x] * (1.f - weight) + image[x] * weight;
+			image[x] = accumulated[x];
+		}
+	}, false, [&](int y) { return embreeRowNode(y); });
+
 }
\ No newline at end of file
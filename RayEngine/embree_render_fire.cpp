@@ -3,17 +3,17 @@
 // Fires a single primary ray and stores its color in the buffer
 void RayEngine::embreeRenderFirePrimaryRay(int x, int y) {
 
-	float dx = ((float)(Embree.offset + x) / window.width) * 2.f - 1.f;
-	float dy = ((float)y / window.height) * 2.f - 1.f;
+	float dx = ((Embree.frame.embreeOffset + x + Embree.frame.jitterX) / Embree.frame.width) * 2.f - 1.f;
+	float dy = ((y + Embree.frame.jitterY) / Embree.frame.height) * 2.f - 1.f;
 
-	Vec3 rayDir = dx * rayXaxis + dy * rayYaxis + rayZaxis;
+	Vec3 rayDir = dx * Embree.frame.rayXaxis + dy * Embree.frame.rayYaxis + Embree.frame.rayZaxis;
 
 	Embree::Ray ray;
 	ray.x = x;
 	ray.y = y;
-	ray.org[0] = rayOrg.x();
-	ray.org[1] = rayOrg.y();
-	ray.org[2] = rayOrg.z();
+	ray.org[0] = Embree.frame.rayOrg.x();
+	ray.org[1] = Embree.frame.rayOrg.y();
+	ray.org[2] = Embree.frame.rayOrg.z();
 	ray.dir[0] = rayDir.x();
 	ray.dir[1] = rayDir.y();
 	ray.dir[2] = rayDir.z();
@@ -25,38 +25,42 @@ void RayEngine::embreeRenderFirePrimaryRay(int x, int y) {
 	ray.mask = EMBREE_RAY_VALID;
 	ray.time = 0.f;
 
-	rtcIntersect(curScene->Embree.scene, ray);
+	rtcIntersect(Embree.frame.scene->Embree.scene, ray);
+	embreeCheckerStore(x, y, ray.instID, ray.geomID, ray.primID, ray.tfar);
 
 	Color result;
-	embreeRenderTraceRay(ray, 0, 0, result);
+	(this->*Embree.traceRayKernels[Embree.frame.traceFeatures])(ray, 0, 0, result);
 
-	Embree.buffer[y * window.width + x] = result;
+	Embree.buffer[embreeBufferIndex(x, y)] = result;
 
 }
 
-// Fires a packet of rays and calculates each color together/individually and stores in the buffer
-void RayEngine::embreeRenderFirePrimaryPacket(int x, int y) {
+// Fires a packet of rays and calculates each color together/individually and stores in the buffer.
+// The lanes are every Embree.checkerStep-th pixel from x, up to x1.
+template<int N>
+void RayEngine::embreeRenderFirePrimaryPacket(int x, int y, int x1) {
 
-	Embree::RayPacket packet;
+	Embree::RayPacket<N> packet;
 	packet.x = x;
 	packet.y = y;
+	int step = Embree.checkerStep;
 
-	for (int i = 0; i < EMBREE_PACKET_SIZE; i++) {
+	for (int i = 0; i < N; i++) {
 
-		if (x + i >= Embree.width) {
+		if (x + i * step >= x1) {
 			packet.valid[i] = EMBREE_RAY_INVALID;
 			continue;
 		} else
 			packet.valid[i] = EMBREE_RAY_VALID;
 
-		float dx = ((float)(Embree.offset + x + i) / window.width) * 2.f - 1.f;
-		float dy = ((float)y / window.height) * 2.f - 1.f;
+		float dx = ((Embree.frame.embreeOffset + x + i * step + Embree.frame.jitterX) / Embree.frame.width) * 2.f - 1.f;
+		float dy = ((y + Embree.frame.jitterY) / Embree.frame.height) * 2.f - 1.f;
 
-		Vec3 rayDir = dx * rayXaxis + dy * rayYaxis + rayZaxis;
+		Vec3 rayDir = dx * Embree.frame.rayXaxis + dy * Embree.frame.rayYaxis + Embree.frame.rayZaxis;
 
-		packet.orgx[i] = rayOrg.x();
-		packet.orgy[i] = rayOrg.y(); 
-		packet.orgz[i] = rayOrg.z();
+		packet.orgx[i] = Embree.frame.rayOrg.x();
+		packet.orgy[i] = Embree.frame.rayOrg.y(); 
+		packet.orgz[i] = Embree.frame.rayOrg.z();
 		packet.dirx[i] = rayDir.x();
 		packet.diry[i] = rayDir.y();
 		packet.dirz[i] = rayDir.z();
@@ -70,31 +74,34 @@ void RayEngine::embreeRenderFirePrimaryPacket(int x, int y) {
 
 	}
 
-	rtcIntersect8(packet.valid, curScene->Embree.scene, packet);
+	EmbreePacket<N>::intersect(packet.valid, Embree.frame.scene->Embree.scene, packet);
+	for (int i = 0; i < N; i++)
+		if (packet.valid[i] == EMBREE_RAY_VALID)
+			embreeCheckerStore(x + i * step, y, packet.instID[i], packet.geomID[i], packet.primID[i], packet.tfar[i]);
 
-	if (Embree.enablePacketsSecondary) {
+	if (Embree.frame.enablePacketsSecondary) {
 
 		// Continue with the same packet for reflections, shadows etc.
 
-	    Color result[EMBREE_PACKET_SIZE];
+		Color result[N];
 		embreeRenderTracePacket(packet, 0, 0, result);
 
-		for (int i = 0; i < EMBREE_PACKET_SIZE; i++)
+		for (int i = 0; i < N; i++)
 			if (packet.valid[i] == EMBREE_RAY_VALID)
-				Embree.buffer[y * window.width + x + i] = result[i];
+				Embree.buffer[embreeBufferIndex(x + i * step, y)] = result[i];
 
 	} else {
 
 		// Split up the packet into rays and calculate each separately.
 		// Has shown to give better performance, probably due to incoherence.
 
-		for (int i = 0; i < EMBREE_PACKET_SIZE; i++) {
+		for (int i = 0; i < N; i++) {
 
 			if (packet.valid[i] == EMBREE_RAY_INVALID)
 				continue;
 
 			Embree::Ray ray;
-			ray.x = x + i;
+			ray.x = x + i * step;
 			ray.y = y;
 			ray.org[0] = packet.orgx[i];
 			ray.org[1] = packet.orgy[i];
@@ -113,12 +120,15 @@ void RayEngine::embreeRenderFirePrimaryPacket(int x, int y) {
 			ray.time = packet.time[i];
 
 			Color result;
-			embreeRenderTraceRay(ray, 0, 0, result);
+			(this->*Embree.traceRayKernels[Embree.frame.traceFeatures])(ray, 0, 0, result);
 
-			Embree.buffer[y * window.width + x + i] = result;
+			Embree.buffer[embreeBufferIndex(x + i * step, y)] = result;
 
 		}
 
 	}
 
-}
\ No newline at end of file
+}
+template void RayEngine::embreeRenderFirePrimaryPacket<4>(int x, int y, int x1);
+template void RayEngine::embreeRenderFirePrimaryPacket<8>(int x, int y, int x1);
+template void RayEngine::embreeRenderFirePrimaryPacket<16>(int x, int y, int x1);
\ No newline at end of file
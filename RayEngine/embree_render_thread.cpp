@@ -0,0 +1,125 @@
+#include "rayengine.h"
+
+// The render thread renders the newest requested frame and publishes it for the loop, which
+// presents whatever finished last. The pipelined mode and the threaded hybrid renderer use the
+// same thread, and wait for the frame they requested. Everything the thread reads besides its FrameState is only
+// changed by the loop after settingsChange, which waits for it.
+
+void RayEngine::embreeStartRenderThread() {
+
+	Embree.hasRequest = Embree.hasReady = Embree.rendering = Embree.renderQuit = false;
+	Embree.renderThread = thread(&RayEngine::embreeRenderThreadLoop, this);
+
+}
+
+void RayEngine::embreeStopRenderThread() {
+
+	if (!Embree.renderThread.joinable())
+		return;
+
+	{
+		lock_guard<mutex> lock(Embree.renderLock);
+		Embree.renderQuit = true;
+	}
+	Embree.renderRequested.notify_one();
+	Embree.renderThread.join();
+
+}
+
+void RayEngine::embreeRenderThreadLoop() {
+
+	while (true) {
+
+		FrameState frame;
+
+		{
+			unique_lock<mutex> lock(Embree.renderLock);
+			Embree.renderRequested.wait(lock, [this]() { return Embree.renderQuit || Embree.hasRequest; });
+			if (Embree.renderQuit)
+				return;
+			frame = Embree.requestedFrame;
+			Embree.hasRequest = false;
+			Embree.rendering = true;
+		}
+
+		embreeRender(frame);
+
+		// Publish, replacing a frame the loop hasn't taken
+		{
+			lock_guard<mutex> lock(Embree.renderLock);
+			Embree.image.swap(Embree.readyImage);
+			Embree.readyFrame = Embree.frame;
+			embreeCollectStats(Embree.readyStats);
+			Embree.hasReady = true;
+			Embree.rendering = false;
+		}
+		Embree.renderPublished.notify_all();
+
+	}
+
+}
+
+// Waits for the frame being rendered and drops the requested one, so the loop can change what
+// the render thread reads (settings, the scene, the window size). The finished frame is still published.
+void RayEngine::embreeRenderThreadWait() {
+
+	if (!Embree.renderThread.joinable())
+		return;
+
+	unique_lock<mutex> lock(Embree.renderLock);
+	Embree.hasRequest = false;
+	Embree.renderPublished.wait(lock, [this]() { return !Embree.rendering; });
+
+}
+
+// Posts the frame to render next, replacing a request the thread hasn't started
+void RayEngine::embreeRequestFrame(const FrameState& frame) {
+
+	{
+		lock_guard<mutex> lock(Embree.renderLock);
+		Embree.requestedFrame = frame;
+		Embree.hasRequest = true;
+	}
+	Embree.renderRequested.notify_one();
+
+}
+
+// Makes the newest published frame the displayed one. Doesn't wait if none is ready, the last one
+// is drawn again and the loop is paced by the buffer swap. With wait set it first waits until the
+// requested frame is done, for the modes that show every frame they request.
+bool RayEngine::embreeTakeFrame(bool wait) {
+
+	unique_lock<mutex> lock(Embree.renderLock);
+	if (wait)
+		Embree.renderPublished.wait(lock, [this]() { return !Embree.hasRequest && !Embree.rendering; });
+	if (!Embree.hasReady)
+		return false;
+
+	Embree.readyImage.swap(Embree.displayImage);
+	Embree.displayFrame = Embree.readyFrame;
+	Embree.displayStats = Embree.readyStats;
+	Embree.displayUploaded = false;
+	Embree.hasReady = false;
+	embreeUpdateScale();
+	return true;
+
+}
+
+void RayEngine::embreeCollectStats(Embree::FrameStats& stats) {
+
+	stats.renderTime = Embree.renderTimer.lastTime;
+	stats.avgRenderTime = Embree.renderTimer.avgTime;
+	stats.tailTime = Embree.tailTime;
+	stats.resolveTime = Embree.resolveTimer.lastTime;
+	stats.idleTime = Embree.idleTime;
+	stats.steals = Embree.steals;
+	stats.filterCalls = Embree.filterCalls;
+	stats.aoSamplesPerHit = Embree.aoSamplesPerHit;
+	stats.cacheHitRate = Embree.cacheHitRate;
+	stats.checkerReuse = Embree.checkerReuse;
+	stats.aoCacheCells = Embree.aoCache.usedCells;
+	stats.skippedTiles = Embree.skippedTiles;
+	stats.accumulatedFrames = Embree.accumulatedFrames;
+	stats.tileTasks = Embree.tileTasks;
+
+}
@@ -1,4 +1,5 @@
 #include "rayengine.h"
+#include "simd.h"
 
 // Stores the properties of a ray hit
 struct RayHit {
@@ -14,6 +15,256 @@ struct RayHit {
 
 };
 
+// Stores the properties of a packet of ray hits, one array per component (SoA) so that
+// the shading kernels below can process every lane with the same instruction
+template<int N>
+struct HitPacket {
+
+	float active[N];
+	float posx[N], posy[N], posz[N];
+	float normalx[N], normaly[N], normalz[N];
+	float texCoordx[N], texCoordy[N];
+	float textureR[N], textureG[N], textureB[N], transparency[N];
+	float diffuseR[N], diffuseG[N], diffuseB[N];
+	float specularR[N], specularG[N], specularB[N];
+	float resultR[N], resultG[N], resultB[N];
+	float occluded[N];
+
+	// Material shading constants
+	Material* material[N];
+	float ambientR[N], ambientG[N], ambientB[N];
+	float shineR[N], shineG[N], shineB[N], shineExponent[N];
+
+	__forceinline void gatherMaterial(int i, const EmbreeHitDecode& decode) {
+		material[i] = decode.material;
+		ambientR[i] = decode.ambient.r();
+		ambientG[i] = decode.ambient.g();
+		ambientB[i] = decode.ambient.b();
+		shineR[i] = decode.specular.r();
+		shineG[i] = decode.specular.g();
+		shineB[i] = decode.specular.b();
+		shineExponent[i] = decode.shineExponent;
+	}
+
+	// Gives an unused lane a material that shades to black, so the kernels see no garbage
+	__forceinline void clearMaterial(int i) {
+		material[i] = nullptr;
+		ambientR[i] = ambientG[i] = ambientB[i] = 0.f;
+		shineR[i] = shineG[i] = shineB[i] = shineExponent[i] = 0.f;
+	}
+
+};
+
+// Triangle vertex attributes and object matrix of each lane, gathered for interpolation
+template<int N>
+struct HitPacketVertices {
+
+	float n0x[N], n0y[N], n0z[N], n1x[N], n1y[N], n1z[N], n2x[N], n2y[N], n2z[N];
+	float t0x[N], t0y[N], t1x[N], t1y[N], t2x[N], t2y[N];
+	float m[9][N];
+
+	// Fills an unused lane with values that interpolate safely
+	__forceinline void clear(int i) {
+		n0x[i] = n0y[i] = n1x[i] = n1y[i] = n2x[i] = n2y[i] = 0.f;
+		n0z[i] = n1z[i] = n2z[i] = 1.f;
+		t0x[i] = t0y[i] = t1x[i] = t1y[i] = t2x[i] = t2y[i] = 0.f;
+		for (int e = 0; e < 9; e++)
+			m[e][i] = (e % 4 == 0) ? 1.f : 0.f;
+	}
+
+	__forceinline void gather(int i, const EmbreeHitDecode& decode, int primID) {
+
+		const TrianglePrimitive& prim = decode.indexData[primID];
+		const Vec3& n0 = decode.normalData[prim.indices[0]];
+		const Vec3& n1 = decode.normalData[prim.indices[1]];
+		const Vec3& n2 = decode.normalData[prim.indices[2]];
+		const Vec2& t0 = decode.texCoordData[prim.indices[0]];
+		const Vec2& t1 = decode.texCoordData[prim.indices[1]];
+		const Vec2& t2 = decode.texCoordData[prim.indices[2]];
+
+		n0x[i] = n0.x(); n0y[i] = n0.y(); n0z[i] = n0.z();
+		n1x[i] = n1.x(); n1y[i] = n1.y(); n1z[i] = n1.z();
+		n2x[i] = n2.x(); n2y[i] = n2.y(); n2z[i] = n2.z();
+		t0x[i] = t0.x(); t0y[i] = t0.y();
+		t1x[i] = t1.x(); t1y[i] = t1.y();
+		t2x[i] = t2.x(); t2y[i] = t2.y();
+
+		for (int e = 0; e < 9; e++)
+			m[e][i] = decode.normalMatrix[e];
+
+	}
+
+};
+
+// Whether the mean occlusion of a hit's AO samples so far is within AO_ADAPTIVE_ERROR, judged by its
+// standard error. A hit whose samples all agree is converged after the first batch.
+static __forceinline bool embreeAoConverged(float occluded, float occludedSqr, int samples) {
+
+	if (samples < 2)
+		return false;
+
+	float mean = occluded / samples;
+	float variance = max(occludedSqr - occluded * mean, 0.f) / (samples - 1);
+	return variance / samples <= AO_ADAPTIVE_ERROR * AO_ADAPTIVE_ERROR;
+
+}
+
+// The shading kernels below take the lanes of a packet a SIMD register at a time (see PacketSimd).
+// Inactive lanes are computed like the others and masked out where it matters, so no lane branches.
+
+// Computes the hit positions from the ray packet
+template<int N>
+static __forceinline void hitPacketPosition(HitPacket<N>& hits, RayEngine::Embree::RayPacket<N>& packet) {
+
+	typedef typename PacketSimd<N>::Type V;
+
+	for (int i = 0; i < N; i += V::size) {
+		V t = V::load(&packet.tfar[i]) & (V::load(&hits.active[i]) > V(0.f));
+		(V::load(&packet.orgx[i]) + V::load(&packet.dirx[i]) * t).store(&hits.posx[i]);
+		(V::load(&packet.orgy[i]) + V::load(&packet.diry[i]) * t).store(&hits.posy[i]);
+		(V::load(&packet.orgz[i]) + V::load(&packet.dirz[i]) * t).store(&hits.posz[i]);
+	}
+
+}
+
+// Interpolates the normals and texture coordinates of all lanes and transforms the normals to world space
+template<int N>
+static __forceinline void hitPacketInterpolate(HitPacket<N>& hits, HitPacketVertices<N>& v, RayEngine::Embree::RayPacket<N>& packet) {
+
+	typedef typename PacketSimd<N>::Type V;
+
+	for (int i = 0; i < N; i += V::size) {
+
+		V bu = V::load(&packet.u[i]);
+		V bv = V::load(&packet.v[i]);
+		V bw = V(1.f) - bu - bv;
+
+		V nx = bw * V::load(&v.n0x[i]) + bu * V::load(&v.n1x[i]) + bv * V::load(&v.n2x[i]);
+		V ny = bw * V::load(&v.n0y[i]) + bu * V::load(&v.n1y[i]) + bv * V::load(&v.n2y[i]);
+		V nz = bw * V::load(&v.n0z[i]) + bu * V::load(&v.n1z[i]) + bv * V::load(&v.n2z[i]);
+
+		V wx = V::load(&v.m[0][i]) * nx + V::load(&v.m[1][i]) * ny + V::load(&v.m[2][i]) * nz;
+		V wy = V::load(&v.m[3][i]) * nx + V::load(&v.m[4][i]) * ny + V::load(&v.m[5][i]) * nz;
+		V wz = V::load(&v.m[6][i]) * nx + V::load(&v.m[7][i]) * ny + V::load(&v.m[8][i]) * nz;
+		V invLength = V(1.f) / sqrt(wx * wx + wy * wy + wz * wz);
+
+		(wx * invLength).store(&hits.normalx[i]);
+		(wy * invLength).store(&hits.normaly[i]);
+		(wz * invLength).store(&hits.normalz[i]);
+		(bw * V::load(&v.t0x[i]) + bu * V::load(&v.t1x[i]) + bv * V::load(&v.t2x[i])).store(&hits.texCoordx[i]);
+		(bw * V::load(&v.t0y[i]) + bu * V::load(&v.t1y[i]) + bv * V::load(&v.t2y[i])).store(&hits.texCoordy[i]);
+
+		V zero(0.f);
+		zero.store(&hits.diffuseR[i]);
+		zero.store(&hits.diffuseG[i]);
+		zero.store(&hits.diffuseB[i]);
+		zero.store(&hits.specularR[i]);
+		zero.store(&hits.specularG[i]);
+		zero.store(&hits.specularB[i]);
+		zero.store(&hits.occluded[i]);
+
+	}
+
+}
+
+// Defines a packet of rays from the hits towards a light. The valid masks are stored as they're
+// compared, EMBREE_RAY_VALID having all bits set.
+template<int N>
+static __forceinline void hitPacketLightRays(HitPacket<N>& hits, Light& light, RayEngine::Embree::LightRayPacket<N>& lPacket) {
+
+	typedef typename PacketSimd<N>::Type V;
+
+	V lx(light.position.x()), ly(light.position.y()), lz(light.position.z());
+	V invRange(1.f / light.range);
+
+	for (int i = 0; i < N; i += V::size) {
+
+		V px = V::load(&hits.posx[i]), py = V::load(&hits.posy[i]), pz = V::load(&hits.posz[i]);
+		V dx = lx - px;
+		V dy = ly - py;
+		V dz = lz - pz;
+		V distance = sqrt(dx * dx + dy * dy + dz * dz);
+		V invDistance = V(1.f) / distance;
+		V attenuation = max(V(1.f) - distance * invRange, V(0.f)) * V::load(&hits.active[i]);
+
+		attenuation.store(&lPacket.attenuation[i]);
+		distance.store(&lPacket.distance[i]);
+		px.store(&lPacket.orgx[i]);
+		py.store(&lPacket.orgy[i]);
+		pz.store(&lPacket.orgz[i]);
+		(dx * invDistance).store(&lPacket.dirx[i]);
+		(dy * invDistance).store(&lPacket.diry[i]);
+		(dz * invDistance).store(&lPacket.dirz[i]);
+		V(0.01f).store(&lPacket.tnear[i]);
+		distance.store(&lPacket.tfar[i]);
+		V::bits(RTC_INVALID_GEOMETRY_ID).storeMask((int*)&lPacket.instID[i]);
+		V::bits(RTC_INVALID_GEOMETRY_ID).storeMask((int*)&lPacket.geomID[i]);
+		V::bits(RTC_INVALID_GEOMETRY_ID).storeMask((int*)&lPacket.primID[i]);
+		V::bits(EMBREE_RAY_VALID).storeMask((int*)&lPacket.mask[i]);
+		V(0.f).store(&lPacket.time[i]);
+		(attenuation > V(0.f)).storeMask(&lPacket.valid[i]);
+
+	}
+
+}
+
+// Adds the Phong diffuse and specular terms of a traced light packet. The specular power is
+// computed for every lane, and lanes without a shine exponent are masked to 0.
+template<int N>
+static __forceinline void hitPacketPhong(HitPacket<N>& hits, Light& light, RayEngine::Embree::LightRayPacket<N>& lPacket, const Vec3& eye) {
+
+	typedef typename PacketSimd<N>::Type V;
+
+	V cr(light.color.r()), cg(light.color.g()), cb(light.color.b());
+	V ex(eye.x()), ey(eye.y()), ez(eye.z());
+
+	for (int i = 0; i < N; i += V::size) {
+
+		V attenuation = V::load(&lPacket.attenuation[i]) & V::loadMask(&lPacket.valid[i]);
+		V ix = V::load(&lPacket.dirx[i]), iy = V::load(&lPacket.diry[i]), iz = V::load(&lPacket.dirz[i]);
+		V nx = V::load(&hits.normalx[i]), ny = V::load(&hits.normaly[i]), nz = V::load(&hits.normalz[i]);
+
+		// Diffuse factor
+		V nDotI = nx * ix + ny * iy + nz * iz;
+		V diffuseFactor = max(nDotI, V(0.f)) * attenuation;
+		(V::load(&hits.diffuseR[i]) + diffuseFactor * cr).store(&hits.diffuseR[i]);
+		(V::load(&hits.diffuseG[i]) + diffuseFactor * cg).store(&hits.diffuseG[i]);
+		(V::load(&hits.diffuseB[i]) + diffuseFactor * cb).store(&hits.diffuseB[i]);
+
+		// Specular factor
+		V tx = ex - V::load(&hits.posx[i]), ty = ey - V::load(&hits.posy[i]), tz = ez - V::load(&hits.posz[i]);
+		V invEye = V(1.f) / sqrt(tx * tx + ty * ty + tz * tz);
+		V twoNDotI = nDotI + nDotI;
+		V rx = twoNDotI * nx - ix, ry = twoNDotI * ny - iy, rz = twoNDotI * nz - iz;
+		V rDotE = max((rx * tx + ry * ty + rz * tz) * invEye, V(0.f));
+		V shineExponent = V::load(&hits.shineExponent[i]);
+		V specularFactor = select(shineExponent > V(0.f), pow(rDotE, shineExponent) * attenuation, V(0.f));
+		(V::load(&hits.specularR[i]) + specularFactor * V::load(&hits.shineR[i])).store(&hits.specularR[i]);
+		(V::load(&hits.specularG[i]) + specularFactor * V::load(&hits.shineG[i])).store(&hits.specularG[i]);
+		(V::load(&hits.specularB[i]) + specularFactor * V::load(&hits.shineB[i])).store(&hits.specularB[i]);
+
+	}
+
+}
+
+// Combines the texture, lighting and occlusion of all lanes into the hit colors
+template<int N>
+static __forceinline void hitPacketCombine(HitPacket<N>& hits, const Color& sceneAmbient, float aoFactor) {
+
+	typedef typename PacketSimd<N>::Type V;
+
+	V ar(sceneAmbient.r()), ag(sceneAmbient.g()), ab(sceneAmbient.b());
+	V ao(aoFactor);
+
+	for (int i = 0; i < N; i += V::size) {
+		V factor = (V(1.f) - V::load(&hits.occluded[i]) * ao) * (V(1.f) - V::load(&hits.transparency[i]));
+		(V::load(&hits.textureR[i]) * (ar + V::load(&hits.ambientR[i]) + V::load(&hits.diffuseR[i])) * factor + V::load(&hits.specularR[i])).store(&hits.resultR[i]);
+		(V::load(&hits.textureG[i]) * (ag + V::load(&hits.ambientG[i]) + V::load(&hits.diffuseG[i])) * factor + V::load(&hits.specularG[i])).store(&hits.resultG[i]);
+		(V::load(&hits.textureB[i]) * (ab + V::load(&hits.ambientB[i]) + V::load(&hits.diffuseB[i])) * factor + V::load(&hits.specularB[i])).store(&hits.resultB[i]);
+	}
+
+}
+
 // Returns the color of missed rays
 Color RayEngine::embreeRenderSky(Vec3 dir) {
 
@@ -22,7 +273,30 @@ Color RayEngine::embreeRenderSky(Vec3 dir) {
 	float phi = M_PIf * 0.5f - acosf(nDir.y());
 	float u = (theta + M_PIf) * (0.5f * M_1_PIf);
 	float v = 0.5f * (1.0f + sin(phi));
-	return curScene->sky->getPixel(Vec2(u, v));
+	return Embree.frame.scene->sky->getPixel(Vec2(u, v));
+
+}
+
+// Tests a light ray for occlusion. Opaque geometry has no filter to lower the attenuation,
+// so a ray that Embree reports as occluded (geomID 0) is fully absorbed.
+void RayEngine::embreeOccluded(Embree::LightRay& ray) {
+
+	rtcOccluded(Embree.frame.scene->Embree.scene, ray);
+
+	if (ray.geomID != RTC_INVALID_GEOMETRY_ID)
+		ray.attenuation = 0.f;
+
+}
+
+// Tests a packet of light rays for occlusion, see embreeOccluded
+template<int N>
+void RayEngine::embreeOccludedPacket(Embree::LightRayPacket<N>& packet) {
+
+	EmbreePacket<N>::occluded(packet.valid, Embree.frame.scene->Embree.scene, packet);
+
+	for (int i = 0; i < N; i++)
+		if (packet.geomID[i] != RTC_INVALID_GEOMETRY_ID)
+			packet.attenuation[i] = 0.f;
 
 }
 
@@ -32,14 +306,14 @@ void RayEngine::embreeOcclusionFilter(void* data, Embree::LightRay& ray) {
 	if (ray.geomID == RTC_INVALID_GEOMETRY_ID)
 		return;
 
+	((RayEngine*)data)->Embree.threadCounters[WorkerPool::getWorkerIndex()].filterCalls++;
+
 	// Store hit
-	Object* obj = ((RayEngine*)data)->curScene->Embree.instIDmap[ray.instID];
-	TriangleMesh* mesh = (TriangleMesh*)obj->Embree.geomIDmap[ray.geomID];
-	Material* material = mesh->material;
-	Vec2 texCoord = mesh->getTexCoord(ray.primID, ray.u, ray.v);
+	const EmbreeHitDecode& hit = ((RayEngine*)data)->Embree.frame.scene->Embree.getHit(ray.instID, ray.geomID);
+	Vec2 texCoord = hit.getTexCoord(ray.primID, ray.u, ray.v);
 	
 	// Multiply by transparency
-	ray.attenuation *= 1.f - material->diffuse.a() * material->image->getPixel(texCoord).a();
+	ray.attenuation *= 1.f - hit.diffuse.a() * hit.image->getPixel(texCoord).a();
 
 	// Keep going
 	if (ray.attenuation > 0.f)
@@ -48,22 +322,23 @@ void RayEngine::embreeOcclusionFilter(void* data, Embree::LightRay& ray) {
 }
 
 // Lowers the attenuation of a packet of light rays
-void RayEngine::embreeOcclusionFilter8(int* valid, void* data, Embree::LightRayPacket& packet) {
+template<int N>
+void RayEngine::embreeOcclusionFilterPacket(int* valid, void* data, Embree::LightRayPacket<N>& packet) {
+
+	((RayEngine*)data)->Embree.threadCounters[WorkerPool::getWorkerIndex()].filterCalls++;
 
-	for (int i = 0; i < EMBREE_PACKET_SIZE; i++) {
+	for (int i = 0; i < N; i++) {
 
 		// Invalid or already completely absorbed
 		if (valid[i] == EMBREE_RAY_INVALID || packet.geomID[i] == RTC_INVALID_GEOMETRY_ID || packet.attenuation[i] == 0.f)
 			continue;
 
 		// Store hit
-		Object* obj = ((RayEngine*)data)->curScene->Embree.instIDmap[packet.instID[i]];
-		TriangleMesh* mesh = (TriangleMesh*)obj->Embree.geomIDmap[packet.geomID[i]];
-		Material* material = mesh->material;
-		Vec2 texCoord = mesh->getTexCoord(packet.primID[i], packet.u[i], packet.v[i]);
+		const EmbreeHitDecode& hit = ((RayEngine*)data)->Embree.frame.scene->Embree.getHit(packet.instID[i], packet.geomID[i]);
+		Vec2 texCoord = hit.getTexCoord(packet.primID[i], packet.u[i], packet.v[i]);
 
 		// Multiply by transparency
-		packet.attenuation[i] *= 1.f - material->diffuse.a() * material->image->getPixel(texCoord).a();
+		packet.attenuation[i] *= 1.f - hit.diffuse.a() * hit.image->getPixel(texCoord).a();
 
 		// Keep going
 		if (packet.attenuation[i] > 0.f)
@@ -73,35 +348,58 @@ void RayEngine::embreeOcclusionFilter8(int* valid, void* data, Embree::LightRayP
 
 }
 
-// Processes a single ray
+// Processes a single ray. Instantiated once per combination of TraceFeature flags, so that
+// disabled features are compiled out instead of being tested for every ray.
+template<int F>
 void RayEngine::embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int refractDepth, Color& result) {
 
 	// No object hit, return sky color
 	if (ray.geomID == RTC_INVALID_GEOMETRY_ID) {
+		if (F & TF_CACHE)
+			Embree.nextCache[ray.y * Embree.frame.width + ray.x].geomID = RTC_INVALID_GEOMETRY_ID;
 		result = embreeRenderSky(ray.dir);
 		return;
 	}
 
+	Embree.threadCounters[WorkerPool::getWorkerIndex()].shadedHits++;
+
 	// Store hit
 	RayHit hit;
 	hit.diffuse = hit.specular = { 0.f };
 	hit.pos = Vec3(ray.org) + Vec3(ray.dir) * ray.tfar;
-	hit.obj = curScene->Embree.instIDmap[ray.instID];
-	hit.mesh = (TriangleMesh*)hit.obj->Embree.geomIDmap[ray.geomID];
-	hit.material = hit.mesh->material;
-	hit.normal = Vec3::normalize(hit.obj->matrix * hit.mesh->getNormal(ray.primID, ray.u, ray.v));
-	hit.texCoord = hit.mesh->getTexCoord(ray.primID, ray.u, ray.v);
-	hit.texture = hit.material->diffuse * hit.material->image->getPixel(hit.texCoord);
+	const EmbreeHitDecode& decode = Embree.frame.scene->Embree.getHit(ray.instID, ray.geomID);
+	hit.obj = decode.obj;
+	hit.mesh = decode.mesh;
+	hit.material = decode.material;
+	hit.normal = Vec3::normalize(decode.getNormal(ray.primID, ray.u, ray.v));
+	hit.texCoord = decode.getTexCoord(ray.primID, ray.u, ray.v);
+	hit.texture = decode.diffuse * decode.image->getPixel(hit.texCoord);
 	hit.transparency = 1.f - hit.texture.a();
 	hit.occluded = 0.f;
 
+	// A primary hit finds the shadow and AO results of its surface point in the last frame's cache,
+	// and stores its own for the next frame. Its shadow rays are only traced every few frames.
+	const Embree::CacheEntry* cached = nullptr;
+	Embree::CacheEntry* store = nullptr;
+	bool refresh = true;
+	if (F & TF_CACHE) {
+		cached = embreeCacheLookup(ray, hit.pos);
+		refresh = !cached || (ray.x + ray.y + Embree.frame.number) % EMBREE_CACHE_REFRESH == 0;
+		store = &Embree.nextCache[ray.y * Embree.frame.width + ray.x];
+		store->pos = hit.pos;
+		store->instID = ray.instID;
+		store->geomID = ray.geomID;
+		store->primID = ray.primID;
+		store->occluded = 0.f;
+		for (int l = 0; l < EMBREE_CACHE_LIGHTS; l++)
+			store->shadow[l] = 1.f;
+	}
+
 	// Check lights
-#if EMBREE_ONE_LIGHT
-	Light& light = curScene->lights[0];
-#else
-	for (int l = 0; l < curScene->lights.size(); l++) {
-		Light& light = curScene->lights[l];
- #endif
+	int numLights = (F & TF_MULTI_LIGHT) ? Embree.frame.scene->lights.size() : 1;
+	for (int l = 0; l < numLights; l++) {
+
+		Light& light = Embree.frame.scene->lights[l];
 
 		float distance = Vec3::length(light.position - hit.pos);
 		float attenuation = max(1.f - distance / light.range, 0.f);
@@ -109,39 +407,51 @@ void RayEngine::embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int ref
 		// Light is in reach
 		if (attenuation > 0.f) {
 
-			// Define light ray
 			Vec3 incidence = Vec3::normalize(light.position - hit.pos);
-			Embree::LightRay lRay;
-			lRay.org[0] = hit.pos.x();
-			lRay.org[1] = hit.pos.y();
-			lRay.org[2] = hit.pos.z();
-			lRay.dir[0] = incidence.x();
-			lRay.dir[1] = incidence.y();
-			lRay.dir[2] = incidence.z();
-			lRay.tnear = 0.01f;
-			lRay.tfar = distance;
-			lRay.instID =
-			lRay.geomID =
-			lRay.primID = RTC_INVALID_GEOMETRY_ID;
-			lRay.mask = EMBREE_RAY_VALID;
-			lRay.time = 0.f;
-			lRay.attenuation = attenuation;
-
-			// Check occlusion
-			rtcOccluded(curScene->Embree.scene, lRay);
+			bool reuse = (!refresh && l < EMBREE_CACHE_LIGHTS);
+			float visibility = reuse ? cached->shadow[l] : 1.f;
+
+			// Trace the shadow ray unless the cached visibility is reused
+			if (!reuse) {
+
+				// Define light ray
+				Embree::LightRay lRay;
+				lRay.org[0] = hit.pos.x();
+				lRay.org[1] = hit.pos.y();
+				lRay.org[2] = hit.pos.z();
+				lRay.dir[0] = incidence.x();
+				lRay.dir[1] = incidence.y();
+				lRay.dir[2] = incidence.z();
+				lRay.tnear = 0.01f;
+				lRay.tfar = distance;
+				lRay.instID =
+				lRay.geomID =
+				lRay.primID = RTC_INVALID_GEOMETRY_ID;
+				lRay.mask = EMBREE_RAY_VALID;
+				lRay.time = 0.f;
+				lRay.attenuation = attenuation;
+
+				// Check occlusion
+				embreeOccluded(lRay);
+				visibility = lRay.attenuation / attenuation;
+
+			}
+
+			if (store && l < EMBREE_CACHE_LIGHTS)
+				store->shadow[l] = visibility;
 
 			// The ray was not fully absorbed, add light contribution
-			if (lRay.attenuation > 0.f) {
+			if (visibility > 0.f) {
 
 				// Diffuse factor
-				float diffuseFactor = max(Vec3::dot(hit.normal, incidence), 0.f) * lRay.attenuation;
+				float diffuseFactor = max(Vec3::dot(hit.normal, incidence), 0.f) * attenuation * visibility;
 				hit.diffuse += diffuseFactor * light.color;
 
 				// Specular factor
-				if (hit.material->shineExponent > 0.f) {
-					Vec3 toEye = Vec3::normalize(curCamera->position - hit.pos);
+				if ((F & TF_SPECULAR) && hit.material->shineExponent > 0.f) {
+					Vec3 toEye = Vec3::normalize(Embree.frame.rayOrg - hit.pos);
 					Vec3 reflection = Vec3::reflect(incidence, hit.normal);
-					float specularFactor = pow(max(Vec3::dot(reflection, toEye), 0.f), hit.material->shineExponent) * lRay.attenuation;
+					float specularFactor = pow(max(Vec3::dot(reflection, toEye), 0.f), hit.material->shineExponent) * attenuation * visibility;
 					hit.specular += specularFactor * hit.material->specular;
 				}
 
@@ -149,65 +459,36 @@ void RayEngine::embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int ref
 
 		}
 
-#if !(EMBREE_ONE_LIGHT)
 	}
-#endif
 
 	//// Ambient occlusion ////
 
-	if (enableAo) {
-
-		float invSamples = 1.f / aoSamples;
-		float invSamplesSqrt = 1.f / aoSamplesSqrt;
-		Vec2 noiseTexCoord = Vec2((float)(Embree.offset + ray.x) / window.width, (float)ray.y / window.height) * aoNoiseScale;
-		Color noise = aoNoiseImage->getPixel(noiseTexCoord);
-		optix::Onb onb(optix::make_float3(hit.normal.x(), hit.normal.y(), hit.normal.z())); // Re-use OptiX's orthogonal base cus I'm lazy
-
-		// TODO: Find out if occluded8 is worse
-		for (int a = 0; a < aoSamples; a++) {
-
-			// Define sample vector
-			float u1 = (float(a % aoSamplesSqrt) + noise.r()) * invSamplesSqrt;
-			float u2 = (float(a / aoSamplesSqrt) + noise.g()) * invSamplesSqrt;
-			optix::float3 sampleVector;
-			cosine_sample_hemisphere(u1, u2, sampleVector);
-			onb.inverse_transform(sampleVector);
-
-			// Define sample ray
-			Embree::LightRay aoRay;
-			aoRay.org[0] = hit.pos.x();
-			aoRay.org[1] = hit.pos.y();
-			aoRay.org[2] = hit.pos.z();
-			aoRay.dir[0] = sampleVector.x;
-			aoRay.dir[1] = sampleVector.y;
-			aoRay.dir[2] = sampleVector.z;
-			aoRay.tnear = 0.01f;
-			aoRay.tfar = curScene->aoRadius;
-			aoRay.instID =
-			aoRay.geomID =
-			aoRay.primID = RTC_INVALID_GEOMETRY_ID;
-			aoRay.mask = EMBREE_RAY_VALID;
-			aoRay.time = 0.f;
-			aoRay.attenuation = 1.f;
-
-			// Check occlusion
-			rtcOccluded(curScene->Embree.scene, aoRay);
-
-			hit.occluded += 1.f - aoRay.attenuation;
+	if (F & TF_AO) {
 
-		}
+		// A cached point traces a part of the samples and blends them into its history
+		Color noise = embreeAoNoise(ray.x, ray.y);
+		float occluded;
+		if (Embree.frame.enableAoCache)
+			occluded = embreeRenderCachedAo(hit.pos, hit.normal, noise);
+		else if (cached) {
+			int samples = max((int)(Embree.frame.aoSamples * EMBREE_CACHE_AO_FRACTION), 1);
+			occluded = cached->occluded + ((this->*embreePacketKernels().traceAo)(hit.pos, hit.normal, noise, samples) - cached->occluded) * EMBREE_CACHE_BLEND;
+		} else
+			occluded = (this->*embreePacketKernels().traceAo)(hit.pos, hit.normal, noise, Embree.frame.aoSamples);
 
-		hit.occluded *= invSamples * aoPower;
+		if (store)
+			store->occluded = occluded;
+		hit.occluded = occluded * Embree.frame.aoPower;
 
 	}
 
 	//// Create color ////
 
-	result = hit.texture * (curScene->ambient + hit.material->ambient + hit.diffuse) * (1.f - hit.occluded) * (1.f - hit.transparency) + hit.specular;
+	result = hit.texture * (Embree.frame.scene->ambient + hit.material->ambient + hit.diffuse) * (1.f - hit.occluded) * (1.f - hit.transparency) + hit.specular;
 
 	//// Reflections ////
 
-	if (enableReflections && hit.material->reflectIntensity > 0.f && reflectDepth < maxReflections) {
+	if ((F & TF_REFLECTIONS) && hit.material->reflectIntensity > 0.f && reflectDepth < Embree.frame.maxReflections) {
 
 		Vec3 reflDir = Vec3::reflect(-Vec3(ray.dir), hit.normal);
 
@@ -226,10 +507,10 @@ void RayEngine::embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int ref
 		rRay.mask = EMBREE_RAY_VALID;
 		rRay.time = 0.f;
 
-		rtcIntersect(curScene->Embree.scene, rRay);
+		rtcIntersect(Embree.frame.scene->Embree.scene, rRay);
 
 		Color reflectResult;
-		embreeRenderTraceRay(rRay, reflectDepth + 1, refractDepth, reflectResult);
+		embreeRenderTraceRay<F & ~TF_CACHE>(rRay, reflectDepth + 1, refractDepth, reflectResult);
 
 		result += reflectResult * hit.material->reflectIntensity;
 
@@ -237,7 +518,7 @@ void RayEngine::embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int ref
 
 	//// Add refractions ////
 
-	if (enableRefractions && hit.transparency > 0.f && refractDepth < maxRefractions) {
+	if ((F & TF_REFRACTIONS) && hit.transparency > 0.f && refractDepth < Embree.frame.maxRefractions) {
 
 		Vec3 refrDir = Vec3::refract(ray.dir, hit.normal, hit.material->refractIndex);
 
@@ -256,10 +537,10 @@ void RayEngine::embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int ref
 		rRay.mask = EMBREE_RAY_VALID;
 		rRay.time = 0.f;
 
-		rtcIntersect(curScene->Embree.scene, rRay);
+		rtcIntersect(Embree.frame.scene->Embree.scene, rRay);
 
 		Color refractResult;
-		embreeRenderTraceRay(rRay, reflectDepth, refractDepth + 1, refractResult);
+		embreeRenderTraceRay<F & ~TF_CACHE>(rRay, reflectDepth, refractDepth + 1, refractResult);
 
 		result += refractResult * hit.transparency;
 
@@ -269,145 +550,128 @@ void RayEngine::embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int ref
 
 }
 
-// Processes a packet of rays
-void RayEngine::embreeRenderTracePacket(Embree::RayPacket& packet, int reflectDepth, int refractDepth, Color* result) {
+// Processes a packet of rays. Hits are stored as lane arrays (HitPacket) so that normal
+// interpolation, Phong lighting and the color combine run on all lanes per instruction.
+template<int N>
+void RayEngine::embreeRenderTracePacket(Embree::RayPacket<N>& packet, int reflectDepth, int refractDepth, Color* result) {
 	
-#if EMBREE_ONE_LIGHT
-
-	// Create light packet
-	Embree::LightRayPacket lightPacket;
-	for (int i = 0; i < EMBREE_PACKET_SIZE; i++)
-		lightPacket.valid[i] = EMBREE_RAY_INVALID;
-
-#else
-
-    #define MAX_LIGHTS 2
+	// The state below lives in the thread's scratch memory until this call returns
+	Embree::ScratchFrame frame(Embree.scratch[WorkerPool::getWorkerIndex()]);
 
-	// Create light packets (invalid by default)
-	int numLights = min((int)curScene->lights.size(), MAX_LIGHTS - 1);
-	Embree::LightRayPacket lightPackets[MAX_LIGHTS];
-	for (int l = 0; l < MAX_LIGHTS; l++)
-		for (int i = 0; i < EMBREE_PACKET_SIZE; i++)
-			lightPackets[l].valid[i] = EMBREE_RAY_INVALID;
-
-#endif
+	// Light packets, defined for all lanes once the hits are known
+	int numLights = min((int)Embree.frame.scene->lights.size(), EMBREE_MAX_LIGHTS);
+	Embree::LightRayPacket<N>* lightPackets = frame.alloc<Embree::LightRayPacket<N>>(numLights);
 
 	// Reflection packet (invalid by default)
 	bool doReflections = false;
-	Embree::RayPacket reflectPacket;
-	Color reflectResult[EMBREE_PACKET_SIZE];
-	if (enableReflections) {
+	Embree::RayPacket<N>& reflectPacket = *frame.alloc<Embree::RayPacket<N>>(1);
+	Color* reflectResult = frame.alloc<Color>(N);
+	if (Embree.frame.enableReflections) {
 		reflectPacket.x = packet.x;
 		reflectPacket.y = packet.y;
-		for (int i = 0; i < EMBREE_PACKET_SIZE; i++)
+		for (int i = 0; i < N; i++)
 			reflectPacket.valid[i] = EMBREE_RAY_INVALID;
 	}
 
 	// Refraction packet (invalid by default)
 	bool doRefractions = false;
-	Embree::RayPacket refractPacket;
-	Color refractResult[EMBREE_PACKET_SIZE];
-	if (enableRefractions) {
+	Embree::RayPacket<N>& refractPacket = *frame.alloc<Embree::RayPacket<N>>(1);
+	Color* refractResult = frame.alloc<Color>(N);
+	if (Embree.frame.enableRefractions) {
 		refractPacket.x = packet.x;
 		refractPacket.y = packet.y;
-		for (int i = 0; i < EMBREE_PACKET_SIZE; i++)
+		for (int i = 0; i < N; i++)
 			refractPacket.valid[i] = EMBREE_RAY_INVALID;
 	}
 
-	// Ambient occlusion packets
-	Embree::LightRayPacket aoPackets[AO_SAMPLES_MAX];
-	float invSamples = 1.f / aoSamples;
-	float invSamplesSqrt = 1.f / aoSamplesSqrt;
-	if (enableAo)
-		for (int a = 0; a < AO_SAMPLES_MAX; a++)
-			for (int i = 0; i < EMBREE_PACKET_SIZE; i++)
+	// Ambient occlusion packets, one per sample
+	Embree::LightRayPacket<N>* aoPackets = nullptr;
+	if (Embree.frame.enableAo) {
+		aoPackets = frame.alloc<Embree::LightRayPacket<N>>(Embree.frame.aoSamples);
+		for (int a = 0; a < Embree.frame.aoSamples; a++)
+			for (int i = 0; i < N; i++)
 				aoPackets[a].valid[i] = EMBREE_RAY_INVALID;
-	
-	//// Store hits ////
-	
-	RayHit hits[EMBREE_PACKET_SIZE];
-	
-	for (int i = 0; i < EMBREE_PACKET_SIZE; i++) {
+	}
+
+	//// Gather hits ////
+
+	HitPacket<N>& hits = *frame.alloc<HitPacket<N>>(1);
+	HitPacketVertices<N>& vertices = *frame.alloc<HitPacketVertices<N>>(1);
+	int numHits = 0;
+
+	for (int i = 0; i < N; i++) {
+
+		hits.active[i] = 0.f;
+		hits.clearMaterial(i);
+		vertices.clear(i);
 
 		if (packet.valid[i] == EMBREE_RAY_INVALID)
 			continue;
 
-		RayHit& hit = hits[i];
-		Vec3 rayOrg = Vec3(packet.orgx[i], packet.orgy[i], packet.orgz[i]);
-		Vec3 rayDir = Vec3(packet.dirx[i], packet.diry[i], packet.dirz[i]);
-
 		if (packet.geomID[i] == RTC_INVALID_GEOMETRY_ID) {
-			result[i] = embreeRenderSky(rayDir);
-			hit.hitSky = true;
+			result[i] = embreeRenderSky(Vec3(packet.dirx[i], packet.diry[i], packet.dirz[i]));
 			continue;
 		}
 
-		// Store hit properties
-		hit.diffuse = hit.specular = { 0.f };
-		hit.pos = rayOrg + rayDir * packet.tfar[i];
-		hit.obj = curScene->Embree.instIDmap[packet.instID[i]];
-		hit.mesh = (TriangleMesh*)hit.obj->Embree.geomIDmap[packet.geomID[i]];
-		hit.material = hit.mesh->material;
-		hit.normal = Vec3::normalize(hit.obj->matrix * hit.mesh->getNormal(packet.primID[i], packet.u[i], packet.v[i]));
-		hit.texCoord = hit.mesh->getTexCoord(packet.primID[i], packet.u[i], packet.v[i]);
-		hit.texture = hit.material->diffuse * hit.material->image->getPixel(hit.texCoord);
-		hit.transparency = 1.f - hit.texture.a();
-		hit.occluded = 0.f;
-		hit.hitSky = false;
-
-		// Check lights
-#if EMBREE_ONE_LIGHT
-		Light& light = curScene->lights[0];
-#else
-		for (int l = 0; l < numLights; l++) {
-			Light& light = curScene->lights[l];
-#endif
-
-			float distance = Vec3::length(light.position - hit.pos);
-			float attenuation = max(1.f - distance / light.range, 0.f);
-
-			// Light is in reach
-			if (attenuation > 0.f) {
-
-				Vec3 incidence = Vec3::normalize(light.position - hit.pos);
+		const EmbreeHitDecode& decode = Embree.frame.scene->Embree.getHit(packet.instID[i], packet.geomID[i]);
+		vertices.gather(i, decode, packet.primID[i]);
+		hits.gatherMaterial(i, decode);
+		hits.active[i] = 1.f;
+		numHits++;
 
-				// Define light ray
-#if EMBREE_ONE_LIGHT
-				Embree::LightRayPacket& lPacket = lightPacket;
-#else
-				Embree::LightRayPacket& lPacket = lightPackets[l];
-#endif
-				lPacket.attenuation[i] = attenuation;
-				lPacket.distance[i] = distance;
-				lPacket.incidence[i] = incidence;
-				lPacket.orgx[i] = hit.pos.x();
-				lPacket.orgy[i] = hit.pos.y();
-				lPacket.orgz[i] = hit.pos.z();
-				lPacket.dirx[i] = incidence.x();
-				lPacket.diry[i] = incidence.y();
-				lPacket.dirz[i] = incidence.z();
-				lPacket.tnear[i] = 0.01f;
-				lPacket.tfar[i] = distance;
-				lPacket.instID[i] =
-				lPacket.geomID[i] =
-				lPacket.primID[i] = RTC_INVALID_GEOMETRY_ID;
-				lPacket.mask[i] = EMBREE_RAY_VALID;
-				lPacket.time[i] = 0.f;
-				lPacket.valid[i] = EMBREE_RAY_VALID;
+	}
 
-			}
+	if (!numHits)
+		return;
 
-#if !(EMBREE_ONE_LIGHT)
-		}
-#endif
+	Embree.threadCounters[WorkerPool::getWorkerIndex()].shadedHits += numHits;
+
+	//// Shade hits ////
+
+	hitPacketPosition(hits, packet);
+	hitPacketInterpolate(hits, vertices, packet);
+
+	// Textures are fetched per lane
+	for (int i = 0; i < N; i++) {
+		Color texture = { 0.f, 0.f, 0.f, 1.f };
+		if (hits.active[i] > 0.f)
+			texture = hits.material[i]->diffuse * hits.material[i]->image->getPixel(Vec2(hits.texCoordx[i], hits.texCoordy[i]));
+		hits.textureR[i] = texture.r();
+		hits.textureG[i] = texture.g();
+		hits.textureB[i] = texture.b();
+		hits.transparency[i] = 1.f - texture.a();
+	}
+
+	// Define light rays
+	for (int l = 0; l < numLights; l++)
+		hitPacketLightRays(hits, Embree.frame.scene->lights[l], lightPackets[l]);
+
+	// The AO cache cell of each lane and the AO samples it traces
+	AoCache::Cell* aoCells[N];
+	int aoLaneSamples[N];
+	for (int i = 0; i < N; i++) {
+		aoCells[i] = nullptr;
+		aoLaneSamples[i] = 0;
+	}
+
+	// Define secondary rays
+	for (int i = 0; i < N; i++) {
+
+		if (hits.active[i] == 0.f)
+			continue;
+
+		Vec3 hitPos = Vec3(hits.posx[i], hits.posy[i], hits.posz[i]);
+		Vec3 hitNormal = Vec3(hits.normalx[i], hits.normaly[i], hits.normalz[i]);
+		Vec3 rayDir = Vec3(packet.dirx[i], packet.diry[i], packet.dirz[i]);
+		Material* material = hits.material[i];
 
 		// Create reflection ray
-		if (enableReflections && hit.material->reflectIntensity > 0.f && reflectDepth < maxReflections) {
+		if (Embree.frame.enableReflections && material->reflectIntensity > 0.f && reflectDepth < Embree.frame.maxReflections) {
 
-			Vec3 reflDir = Vec3::reflect(-rayDir, hit.normal);
-			reflectPacket.orgx[i] = hit.pos.x();
-			reflectPacket.orgy[i] = hit.pos.y();
-			reflectPacket.orgz[i] = hit.pos.z();
+			Vec3 reflDir = Vec3::reflect(-rayDir, hitNormal);
+			reflectPacket.orgx[i] = hitPos.x();
+			reflectPacket.orgy[i] = hitPos.y();
+			reflectPacket.orgz[i] = hitPos.z();
 			reflectPacket.dirx[i] = reflDir.x();
 			reflectPacket.diry[i] = reflDir.y();
 			reflectPacket.dirz[i] = reflDir.z();
@@ -424,12 +688,12 @@ void RayEngine::embreeRenderTracePacket(Embree::RayPacket& packet, int reflectDe
 		}
 
 		// Create refraction ray
-		if (enableRefractions && hit.transparency > 0.f && refractDepth < maxRefractions) {
+		if (Embree.frame.enableRefractions && hits.transparency[i] > 0.f && refractDepth < Embree.frame.maxRefractions) {
 
-			Vec3 refrDir = Vec3::refract(rayDir, hit.normal, hit.material->refractIndex);
-			refractPacket.orgx[i] = hit.pos.x();
-			refractPacket.orgy[i] = hit.pos.y();
-			refractPacket.orgz[i] = hit.pos.z();
+			Vec3 refrDir = Vec3::refract(rayDir, hitNormal, material->refractIndex);
+			refractPacket.orgx[i] = hitPos.x();
+			refractPacket.orgy[i] = hitPos.y();
+			refractPacket.orgz[i] = hitPos.z();
 			refractPacket.dirx[i] = refrDir.x();
 			refractPacket.diry[i] = refrDir.y();
 			refractPacket.dirz[i] = refrDir.z();
@@ -446,32 +710,38 @@ void RayEngine::embreeRenderTracePacket(Embree::RayPacket& packet, int reflectDe
 		}
 
 		// Create ambient occlusion samples
-		if (enableAo) {
+		if (Embree.frame.enableAo) {
+
+			// A lane of a full cache cell takes its mean and traces none, as embreeRenderCachedAo
+			aoLaneSamples[i] = Embree.frame.aoSamples;
+			if (Embree.frame.enableAoCache && (aoCells[i] = Embree.aoCache.find(hitPos, hitNormal))) {
+				uint64_t value = aoCells[i]->value.load(memory_order_relaxed);
+				if (AoCache::getSamples(value) >= (uint)(Embree.frame.aoSamples * AO_CACHE_FILL)) {
+					hits.occluded[i] = AoCache::getMean(value);
+					aoLaneSamples[i] = 0;
+				} else
+					aoLaneSamples[i] = min(AO_CACHE_BATCH, Embree.frame.aoSamples);
+			}
 
-			Vec2 noiseTexCoord = Vec2((float)(Embree.offset + packet.x + i) / window.width, (float)packet.y / window.height) * aoNoiseScale;
-			Color noise = aoNoiseImage->getPixel(noiseTexCoord);
-			optix::Onb onb(optix::make_float3(hit.normal.x(), hit.normal.y(), hit.normal.z())); // Re-use OptiX's orthogonal base cus I'm lazy
+			AoJitter jitter = embreeAoJitter(embreeAoNoise(packet.x + i * Embree.checkerStep, packet.y));
+			optix::Onb onb(optix::make_float3(hitNormal.x(), hitNormal.y(), hitNormal.z())); // Re-use OptiX's orthogonal base cus I'm lazy
 
-			for (int a = 0; a < aoSamples; a++) {
+			for (int a = 0; a < aoLaneSamples[i]; a++) {
 
-				// Define sample vector
-				float u1 = (float(a % aoSamplesSqrt) + noise.r()) * invSamplesSqrt;
-				float u2 = (float(a / aoSamplesSqrt) + noise.g()) * invSamplesSqrt;
-				optix::float3 sampleVector;
-				cosine_sample_hemisphere(u1, u2, sampleVector);
-				onb.inverse_transform(sampleVector);
+				// Define sample vector, from the strata of the AO table like the single rays
+				Vec3 sampleVector = embreeAoSample(a, jitter, onb);
 
 				// Define sample ray
-				Embree::LightRayPacket& aoPacket = aoPackets[a];
+				Embree::LightRayPacket<N>& aoPacket = aoPackets[a];
 				aoPacket.attenuation[i] = 1.f;
-				aoPacket.orgx[i] = hit.pos.x();
-				aoPacket.orgy[i] = hit.pos.y();
-				aoPacket.orgz[i] = hit.pos.z();
-				aoPacket.dirx[i] = sampleVector.x;
-				aoPacket.diry[i] = sampleVector.y;
-				aoPacket.dirz[i] = sampleVector.z;
+				aoPacket.orgx[i] = hitPos.x();
+				aoPacket.orgy[i] = hitPos.y();
+				aoPacket.orgz[i] = hitPos.z();
+				aoPacket.dirx[i] = sampleVector.x();
+				aoPacket.diry[i] = sampleVector.y();
+				aoPacket.dirz[i] = sampleVector.z();
 				aoPacket.tnear[i] = 0.01f;
-				aoPacket.tfar[i] = curScene->aoRadius;
+				aoPacket.tfar[i] = Embree.frame.scene->aoRadius;
 				aoPacket.instID[i] =
 				aoPacket.geomID[i] =
 				aoPacket.primID[i] = RTC_INVALID_GEOMETRY_ID;
@@ -487,106 +757,342 @@ void RayEngine::embreeRenderTracePacket(Embree::RayPacket& packet, int reflectDe
 	
 	//// Light pass ////
 
-#if EMBREE_ONE_LIGHT
+	for (int l = 0; l < numLights; l++) {
+		embreeOccludedPacket(lightPackets[l]);
+		hitPacketPhong(hits, Embree.frame.scene->lights[l], lightPackets[l], Embree.frame.rayOrg);
+	}
 
-	Light& light = curScene->lights[0];
-	Embree::LightRayPacket& lPacket = lightPacket;
-	rtcOccluded8(lightPacket.valid, curScene->Embree.scene, lightPacket);
+	//// Reflections ////
 
-#else
+	if (doReflections) {
 
-	for (int l = 0; l < numLights; l++) {
+		EmbreePacket<N>::intersect(reflectPacket.valid, Embree.frame.scene->Embree.scene, reflectPacket);
+		embreeRenderTracePacket(reflectPacket, reflectDepth + 1, refractDepth, reflectResult);
+
+	}
+
+	//// Refractions ////
+
+	if (doRefractions) {
+
+		EmbreePacket<N>::intersect(refractPacket.valid, Embree.frame.scene->Embree.scene, refractPacket);
+		embreeRenderTracePacket(refractPacket, reflectDepth, refractDepth + 1, refractResult);
+
+	}
+
+	//// Ambient occlusion ////
 
-		Light& light = curScene->lights[l];
-		Embree::LightRayPacket& lPacket = lightPackets[l];
+	if (Embree.frame.enableAo) {
 
-		rtcOccluded8(lPacket.valid, curScene->Embree.scene, lPacket);
+		float occludedSqr[N];
+		int samples[N];
+		bool converged[N];
+		for (int i = 0; i < N; i++) {
+			occludedSqr[i] = 0.f;
+			samples[i] = 0;
+			converged[i] = false;
+		}
 
-#endif
+		// Lanes in the AO cache trace fewer samples, the packets past the longest lane are empty
+		int aoPacketCount = 0;
+		for (int i = 0; i < N; i++)
+			aoPacketCount = max(aoPacketCount, aoLaneSamples[i]);
 
-		for (int i = 0; i < EMBREE_PACKET_SIZE; i++) {
+		for (int a = 0; a < aoPacketCount; a++) {
 
-			// Light ray was invalid or fully absorbed
-			if (lPacket.valid[i] == EMBREE_RAY_INVALID || lPacket.attenuation[i] == 0.f)
-				continue;
+			// Drop the lanes whose estimate has converged
+			for (int i = 0; i < N; i++)
+				if (converged[i])
+					aoPackets[a].valid[i] = EMBREE_RAY_INVALID;
 
-			RayHit& hit = hits[i];
+			embreeOccludedPacket(aoPackets[a]);
 
-			// Diffuse factor
-			float diffuseFactor = max(Vec3::dot(hit.normal, lPacket.incidence[i]), 0.f) * lPacket.attenuation[i];
-			hit.diffuse += diffuseFactor * light.color;
+			for (int i = 0; i < N; i++) {
+				if (aoPackets[a].valid[i] == EMBREE_RAY_VALID) {
+					float occluded = 1.f - aoPackets[a].attenuation[i];
+					hits.occluded[i] += occluded;
+					occludedSqr[i] += occluded * occluded;
+					samples[i]++;
+				}
+			}
 
-			// Specular factor
-			if (hit.material->shineExponent > 0.0) {
-				Vec3 toEye = Vec3::normalize(curCamera->position - hit.pos);
-				Vec3 reflection = Vec3::reflect(lPacket.incidence[i], hit.normal);
-				float specularFactor = pow(max(Vec3::dot(reflection, toEye), 0.f), hit.material->shineExponent) * lPacket.attenuation[i];
-				hit.specular += specularFactor * hit.material->specular;
+			// Check the lanes after every batch, and stop once all have converged
+			if (Embree.frame.enableAdaptiveAo && (a + 1) % AO_ADAPTIVE_BATCH == 0) {
+				bool sampling = false;
+				for (int i = 0; i < N; i++) {
+					converged[i] = (samples[i] == 0 || embreeAoConverged(hits.occluded[i], occludedSqr[i], samples[i]));
+					sampling = sampling || !converged[i];
+				}
+				if (!sampling)
+					break;
 			}
 
 		}
 
-#if !(EMBREE_ONE_LIGHT)
+		// Lanes with a cache cell add their samples to it and take its new mean
+		Embree::ThreadCounter& counter = Embree.threadCounters[WorkerPool::getWorkerIndex()];
+		for (int i = 0; i < N; i++) {
+			if (samples[i] > 0) {
+				hits.occluded[i] = aoCells[i] ? AoCache::add(aoCells[i], samples[i], hits.occluded[i]) : hits.occluded[i] / samples[i];
+				counter.aoHits++;
+				counter.aoSamples += samples[i];
+			} else if (aoCells[i])
+				counter.aoHits++;
+		}
+
 	}
-#endif
 
-	//// Reflections ////
+	//// Calculate hit colors ////
 
-	if (doReflections) {
+	hitPacketCombine(hits, Embree.frame.scene->ambient, Embree.frame.enableAo ? Embree.frame.aoPower : 0.f);
 
-		rtcIntersect8(reflectPacket.valid, curScene->Embree.scene, reflectPacket);
-		embreeRenderTracePacket(reflectPacket, reflectDepth + 1, refractDepth, reflectResult);
+	for (int i = 0; i < N; i++) {
+
+		if (hits.active[i] == 0.f)
+			continue;
+
+		result[i] = Color(hits.resultR[i], hits.resultG[i], hits.resultB[i]);
+
+		// Add reflections
+		if (hits.material[i]->reflectIntensity > 0.f && doReflections)
+			result[i] += reflectResult[i] * hits.material[i]->reflectIntensity;
+
+		// Add refractions
+		if (hits.transparency[i] > 0.f && doRefractions)
+			result[i] += refractResult[i] * hits.transparency[i];
+
+		result[i].a(1.f);
 
 	}
+	
+}
 
-	//// Refractions ////
+// Returns the scratch memory used by one level of embreeRenderTracePacket, see its allocations
+template<int N>
+static size_t embreeScratchLevelSize(int numLights, int numAoPackets) {
 
-	if (doRefractions) {
+	auto aligned = [](size_t size) { return (size + 63) & ~(size_t)63; };
 
-		rtcIntersect8(refractPacket.valid, curScene->Embree.scene, refractPacket);
-		embreeRenderTracePacket(refractPacket, reflectDepth, refractDepth + 1, refractResult);
+	return
+		aligned(sizeof(RayEngine::Embree::LightRayPacket<N>) * numLights) +
+		2 * (aligned(sizeof(RayEngine::Embree::RayPacket<N>)) + aligned(sizeof(Color) * N)) +
+		aligned(sizeof(RayEngine::Embree::LightRayPacket<N>) * numAoPackets) +
+		aligned(sizeof(HitPacket<N>)) +
+		aligned(sizeof(HitPacketVertices<N>));
 
+}
+
+// Reserves the scratch memory of each thread for the packet width, lights, AO samples
+// and recursion depth of the current settings. Only grows, so this is free once warm.
+void RayEngine::embreeReserveScratch() {
+
+	int numLights = min((int)Embree.frame.scene->lights.size(), EMBREE_MAX_LIGHTS);
+	int numAoPackets = Embree.frame.enableAo ? Embree.frame.aoSamples : 0;
+	int levels = 1 + (Embree.frame.enableReflections ? Embree.frame.maxReflections : 0) + (Embree.frame.enableRefractions ? Embree.frame.maxRefractions : 0);
+
+	size_t size;
+	if (Embree.frame.packetWidth == 16)
+		size = embreeScratchLevelSize<16>(numLights, numAoPackets);
+	else if (Embree.frame.packetWidth == 8)
+		size = embreeScratchLevelSize<8>(numLights, numAoPackets);
+	else
+		size = embreeScratchLevelSize<4>(numLights, numAoPackets);
+	size *= levels;
+
+	if ((int)Embree.scratch.size() < Embree.pool.getNumWorkers())
+		Embree.scratch.resize(Embree.pool.getNumWorkers(), { nullptr, 0, 0 });
+
+	// Each worker's memory is placed on its node (page aligned)
+	for (int w = 0; w < (int)Embree.scratch.size(); w++) {
+		Embree::Scratch& scratch = Embree.scratch[w];
+		if (scratch.size < size) {
+			numaFree(scratch.memory);
+			scratch.memory = (char*)numaAlloc(size, w < Embree.pool.getNumWorkers() ? Embree.pool.workers[w]->node : 0);
+			scratch.size = size;
+		}
+		scratch.used = 0;
 	}
 
-	//// Ambient occlusion ////
+}
 
-	if (enableAo) {
+// Builds the table of AO strata, one entry per stratum of the hemisphere. Every entry keeps
+// the lower bound of its stratum's u1 and the azimuth where it starts, so that a hit only has
+// to jitter within the strata like the packet and wavefront paths do.
+// The strata are ordered by their Morton codes with the bits reversed, so that the first
+// samples of a hit are spread over the hemisphere when adaptive AO stops early.
+void RayEngine::embreeInitAoTable() {
 
-		for (int a = 0; a < aoSamples; a++) {
+	shared_ptr<AoTable> built = make_shared<AoTable>();
+	AoTable& table = *built;
+	int size = ((aoSamples + 15) / 16) * 16;
+	float invSamplesSqrt = 1.f / aoSamplesSqrt;
+	table.cosPhi.assign(size, 1.f);
+	table.sinPhi.assign(size, 0.f);
+	table.u1.assign(size, 0.f);
+
+	vector<uint> keys(aoSamples);
+	table.order.resize(aoSamples);
+	for (int a = 0; a < aoSamples; a++) {
+		uint x = a % aoSamplesSqrt, y = a / aoSamplesSqrt, key = 0;
+		for (int b = 0; b < 8; b++)
+			key |= (((x >> b) & 1) << (15 - 2 * b)) | (((y >> b) & 1) << (14 - 2 * b));
+		keys[a] = key;
+		table.order[a] = a;
+	}
+	stable_sort(table.order.begin(), table.order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+
+	for (int a = 0; a < aoSamples; a++) {
+		int stratum = table.order[a];
+		float phi = float(stratum / aoSamplesSqrt) * invSamplesSqrt * 2.f * M_PIf;
+		table.cosPhi[a] = cos(phi);
+		table.sinPhi[a] = sin(phi);
+		table.u1[a] = float(stratum % aoSamplesSqrt) * invSamplesSqrt;
+	}
 
-			rtcOccluded8(aoPackets[a].valid, curScene->Embree.scene, aoPackets[a]);
+	// A new table, so the frames already built keep theirs
+	Embree.aoTable = built;
 
-			for (int i = 0; i < EMBREE_PACKET_SIZE; i++)
-				if (aoPackets[a].valid[i] == EMBREE_RAY_VALID)
-					hits[i].occluded += 1.f - aoPackets[a].attenuation[i];
+}
 
+// Traces the first samples of the AO table for a hit as packets of N rays sharing its origin.
+// Every sample is jittered within its stratum by the noise and cosine-weighted into the hit's
+// orthogonal base, as embreeAoSample. With adaptive AO the samples stop once the estimate has
+// converged. Returns the mean occlusion.
+template<int N>
+float RayEngine::embreeRenderTraceAo(Vec3 pos, Vec3 normal, Color noise, int samples) {
+
+	optix::Onb onb(optix::make_float3(normal.x(), normal.y(), normal.z()));
+	AoJitter jitter = embreeAoJitter(noise);
+
+	float occluded = 0.f, occludedSqr = 0.f;
+	int traced = 0;
+	Embree::LightRayPacket<N> packet;
+
+	// With adaptive AO the packets don't cross the batches, so the estimate is checked after every batch
+	int step = Embree.frame.enableAdaptiveAo ? min(N, AO_ADAPTIVE_BATCH) : N;
+
+	for (int a = 0; a < samples; a += step) {
+
+		int count = min(samples - a, step);
+		const float* stratumCos = &Embree.frame.aoTable->cosPhi[a];
+		const float* stratumSin = &Embree.frame.aoTable->sinPhi[a];
+		const float* stratumU1 = &Embree.frame.aoTable->u1[a];
+		float dirX[N], dirY[N], dirZ[N];
+
+		// Jitter within the strata, as cosine_sample_hemisphere
+		for (int i = 0; i < N; i++) {
+			float u1 = stratumU1[i] + jitter.u1;
+			float r = sqrt(u1);
+			dirX[i] = r * (stratumCos[i] * jitter.cosPhi - stratumSin[i] * jitter.sinPhi);
+			dirY[i] = r * (stratumSin[i] * jitter.cosPhi + stratumCos[i] * jitter.sinPhi);
+			dirZ[i] = sqrt(max(0.f, 1.f - u1));
 		}
 
-	}
+		// Define sample rays
+		for (int i = 0; i < N; i++) {
+			packet.valid[i] = i < count ? EMBREE_RAY_VALID : EMBREE_RAY_INVALID;
+			packet.orgx[i] = pos.x();
+			packet.orgy[i] = pos.y();
+			packet.orgz[i] = pos.z();
+			packet.dirx[i] = dirX[i] * onb.m_tangent.x + dirY[i] * onb.m_binormal.x + dirZ[i] * onb.m_normal.x;
+			packet.diry[i] = dirX[i] * onb.m_tangent.y + dirY[i] * onb.m_binormal.y + dirZ[i] * onb.m_normal.y;
+			packet.dirz[i] = dirX[i] * onb.m_tangent.z + dirY[i] * onb.m_binormal.z + dirZ[i] * onb.m_normal.z;
+			packet.tnear[i] = 0.01f;
+			packet.tfar[i] = Embree.frame.scene->aoRadius;
+			packet.instID[i] =
+			packet.geomID[i] =
+			packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+			packet.mask[i] = EMBREE_RAY_VALID;
+			packet.time[i] = 0.f;
+			packet.attenuation[i] = 1.f;
+		}
 
-	//// Calculate hit colors ////
+		// Check occlusion
+		embreeOccludedPacket(packet);
 
-	for (int i = 0; i < EMBREE_PACKET_SIZE; i++) {
+		for (int i = 0; i < count; i++) {
+			float o = 1.f - packet.attenuation[i];
+			occluded += o;
+			occludedSqr += o * o;
+		}
+		traced += count;
 
-		RayHit& hit = hits[i];
+		if (Embree.frame.enableAdaptiveAo && traced % AO_ADAPTIVE_BATCH == 0 && embreeAoConverged(occluded, occludedSqr, traced))
+			break;
 
-		if (packet.valid[i] == EMBREE_RAY_INVALID || hit.hitSky)
-			continue;
+	}
 
-		// Create color
-		hit.occluded *= invSamples * aoPower;
-		result[i] = hit.texture * (curScene->ambient + hit.material->ambient + hit.diffuse) * (1.f - hit.occluded) * (1.f - hit.transparency) + hit.specular;
+	Embree::ThreadCounter& counter = Embree.threadCounters[WorkerPool::getWorkerIndex()];
+	counter.aoHits++;
+	counter.aoSamples += traced;
 
-		// Add reflections
-		if (hit.material->reflectIntensity > 0.f && doReflections)
-			result[i] += reflectResult[i] * hit.material->reflectIntensity;
+	return occluded / traced;
 
-		// Add reflections
-		if (hit.transparency > 0.f && doRefractions)
-			result[i] += refractResult[i] * hit.transparency;
+}
 
-		result[i].a(1.f);
+// Returns the occlusion of a hit from its cell in the AO cache. Until the cell holds AO_CACHE_FILL
+// times the samples of a pixel, the hit traces AO_CACHE_BATCH more into it. A hit without a cell
+// traces all its samples.
+float RayEngine::embreeRenderCachedAo(Vec3 pos, Vec3 normal, Color noise) {
+
+	AoCache::Cell* cell = Embree.aoCache.find(pos, normal);
+	if (!cell)
+		return (this->*embreePacketKernels().traceAo)(pos, normal, noise, Embree.frame.aoSamples);
 
+	uint64_t value = cell->value.load(memory_order_relaxed);
+	if (AoCache::getSamples(value) >= (uint)(Embree.frame.aoSamples * AO_CACHE_FILL)) {
+		Embree.threadCounters[WorkerPool::getWorkerIndex()].aoHits++;
+		return AoCache::getMean(value);
 	}
-	
-}
\ No newline at end of file
+
+	int samples = min(AO_CACHE_BATCH, Embree.frame.aoSamples);
+	return AoCache::add(cell, samples, (this->*embreePacketKernels().traceAo)(pos, normal, noise, samples) * samples);
+
+}
+
+// Fills the dispatch table with one trace kernel per feature combination
+template<int F>
+static __forceinline void embreeInitTraceKernels(RayEngine::Embree::TraceRayKernel* kernels) {
+	kernels[F] = &RayEngine::embreeRenderTraceRay<F>;
+	embreeInitTraceKernels<F - 1>(kernels);
+}
+
+template<>
+__forceinline void embreeInitTraceKernels<-1>(RayEngine::Embree::TraceRayKernel* kernels) {}
+
+void RayEngine::embreeInitTraceKernels() {
+	::embreeInitTraceKernels<TF_ALL>(Embree.traceRayKernels);
+}
+
+// Picks the features of the trace kernel from the enabled settings and the current scene.
+// The temporal cache is added per frame by frameBuild.
+void RayEngine::embreeUpdateTraceKernel() {
+
+	int features = 0;
+	if (enableReflections)
+		features |= TF_REFLECTIONS;
+	if (enableRefractions)
+		features |= TF_REFRACTIONS;
+	if (enableAo)
+		features |= TF_AO;
+	if (curScene && curScene->lights.size() > 1)
+		features |= TF_MULTI_LIGHT;
+	if (curScene && curScene->Embree.hasSpecular)
+		features |= TF_SPECULAR;
+
+	Embree.traceFeatures = features;
+
+}
+
+template void RayEngine::embreeOcclusionFilterPacket<4>(int* valid, void* data, Embree::LightRayPacket<4>& packet);
+template void RayEngine::embreeOcclusionFilterPacket<8>(int* valid, void* data, Embree::LightRayPacket<8>& packet);
+template void RayEngine::embreeOcclusionFilterPacket<16>(int* valid, void* data, Embree::LightRayPacket<16>& packet);
+template void RayEngine::embreeRenderTracePacket<4>(Embree::RayPacket<4>& packet, int reflectDepth, int refractDepth, Color* result);
+template void RayEngine::embreeRenderTracePacket<8>(Embree::RayPacket<8>& packet, int reflectDepth, int refractDepth, Color* result);
+template void RayEngine::embreeRenderTracePacket<16>(Embree::RayPacket<16>& packet, int reflectDepth, int refractDepth, Color* result);
+template float RayEngine::embreeRenderTraceAo<4>(Vec3 pos, Vec3 normal, Color noise, int samples);
+template float RayEngine::embreeRenderTraceAo<8>(Vec3 pos, Vec3 normal, Color noise, int samples);
+template float RayEngine::embreeRenderTraceAo<16>(Vec3 pos, Vec3 normal, Color noise, int samples);
+template void RayEngine::embreeOccludedPacket<4>(Embree::LightRayPacket<4>& packet);
+template void RayEngine::embreeOccludedPacket<8>(Embree::LightRayPacket<8>& packet);
+template void RayEngine::embreeOccludedPacket<16>(Embree::LightRayPacket<16>& packet);
\ No newline at end of file
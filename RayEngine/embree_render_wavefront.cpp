@@ -0,0 +1,538 @@
+#include "rayengine.h"
+
+// Renders a tile bounce by bounce. Every bounce intersects the whole ray queue, shades the hits,
+// then traces the queued shadow and AO rays before the reflected/refracted rays form the next queue.
+void RayEngine::embreeRenderWavefront(int x0, int y0, int x1, int y1) {
+
+	Embree::Wavefront& wavefront = Embree.wavefronts[WorkerPool::getWorkerIndex()];
+	wavefront.rays.clear();
+
+	//// Primary rays ////
+
+	for (int y = y0; y < y1; y++) {
+		for (int x = embreeCheckerStart(x0, y); x < x1; x += Embree.checkerStep) {
+
+			float dx = ((Embree.frame.embreeOffset + x + Embree.frame.jitterX) / Embree.frame.width) * 2.f - 1.f;
+			float dy = ((y + Embree.frame.jitterY) / Embree.frame.height) * 2.f - 1.f;
+
+			Vec3 rayDir = dx * Embree.frame.rayXaxis + dy * Embree.frame.rayYaxis + Embree.frame.rayZaxis;
+
+			Embree::WavefrontRay ray;
+			ray.x = x;
+			ray.y = y;
+			ray.org[0] = Embree.frame.rayOrg.x();
+			ray.org[1] = Embree.frame.rayOrg.y();
+			ray.org[2] = Embree.frame.rayOrg.z();
+			ray.dir[0] = rayDir.x();
+			ray.dir[1] = rayDir.y();
+			ray.dir[2] = rayDir.z();
+			ray.tnear = 0.01f;
+			ray.tfar = FLT_MAX;
+			ray.instID =
+			ray.geomID =
+			ray.primID = RTC_INVALID_GEOMETRY_ID;
+			ray.mask = EMBREE_RAY_VALID;
+			ray.time = 0.f;
+			ray.weight = Color(1.f);
+			ray.reflectDepth = 0;
+			ray.refractDepth = 0;
+			wavefront.rays.push_back(ray);
+
+		}
+	}
+
+	//// Bounces ////
+
+	for (int bounce = 0; !wavefront.rays.empty(); bounce++) {
+
+		wavefront.nextRays.clear();
+		wavefront.shadowRays.clear();
+		wavefront.aoRays.clear();
+		wavefront.hits.clear();
+
+		// Intersect and shade the whole queue
+		if (Embree.frame.enableBinning && bounce > 0)
+			embreeRenderWavefrontBin(wavefront.rays, wavefront.binnedRays, wavefront);
+		(this->*embreePacketKernels().wavefrontIntersect)(wavefront.rays);
+		if (bounce == 0)
+			for (const Embree::WavefrontRay& ray : wavefront.rays)
+				embreeCheckerStore(ray.x, ray.y, ray.instID, ray.geomID, ray.primID, ray.tfar);
+		for (uint r = 0; r < wavefront.rays.size(); r++)
+			embreeRenderWavefrontShade(wavefront, wavefront.rays[r]);
+
+		// Light pass
+		if (Embree.frame.enableBinning)
+			embreeRenderWavefrontBin(wavefront.shadowRays, wavefront.binnedLightRays, wavefront);
+		(this->*embreePacketKernels().wavefrontShadows)(wavefront);
+		for (uint r = 0; r < wavefront.shadowRays.size(); r++) {
+
+			Embree::WavefrontLightRay& lRay = wavefront.shadowRays[r];
+
+			// Light ray was fully absorbed
+			if (lRay.attenuation == 0.f)
+				continue;
+
+			Embree::WavefrontHit& hit = wavefront.hits[lRay.hit];
+			Light& light = Embree.frame.scene->lights[lRay.light];
+
+			// Diffuse factor
+			float diffuseFactor = max(Vec3::dot(hit.normal, lRay.incidence), 0.f) * lRay.attenuation;
+			hit.diffuse += diffuseFactor * light.color;
+
+			// Specular factor
+			if (hit.material->shineExponent > 0.f) {
+				Vec3 toEye = Vec3::normalize(Embree.frame.rayOrg - hit.pos);
+				Vec3 reflection = Vec3::reflect(lRay.incidence, hit.normal);
+				float specularFactor = pow(max(Vec3::dot(reflection, toEye), 0.f), hit.material->shineExponent) * lRay.attenuation;
+				hit.specular += specularFactor * hit.material->specular;
+			}
+
+		}
+
+		// Ambient occlusion pass
+		if (Embree.frame.enableBinning)
+			embreeRenderWavefrontBin(wavefront.aoRays, wavefront.binnedLightRays, wavefront);
+		(this->*embreePacketKernels().wavefrontOccluded)(wavefront.aoRays);
+		for (uint r = 0; r < wavefront.aoRays.size(); r++)
+			wavefront.hits[wavefront.aoRays[r].hit].occluded += 1.f - wavefront.aoRays[r].attenuation;
+
+		// Write weighted hit colors
+		float aoFactor = Embree.frame.aoPower / Embree.frame.aoSamples;
+		for (uint h = 0; h < wavefront.hits.size(); h++) {
+
+			Embree::WavefrontHit& hit = wavefront.hits[h];
+			hit.occluded *= aoFactor;
+			Color result = hit.texture * (Embree.frame.scene->ambient + hit.material->ambient + hit.diffuse) * (1.f - hit.occluded) * (1.f - hit.transparency) + hit.specular;
+			Embree.buffer[embreeBufferIndex(hit.x, hit.y)] += hit.weight * result;
+
+		}
+
+		swap(wavefront.rays, wavefront.nextRays);
+
+	}
+
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++)
+			Embree.buffer[embreeBufferIndex(x, y)].a(1.f);
+
+}
+
+// Shades a queued ray, queueing its shadow, AO, reflection and refraction rays
+void RayEngine::embreeRenderWavefrontShade(Embree::Wavefront& wavefront, Embree::WavefrontRay& ray) {
+
+	// No object hit, add sky color
+	if (ray.geomID == RTC_INVALID_GEOMETRY_ID) {
+		Embree.buffer[embreeBufferIndex(ray.x, ray.y)] += ray.weight * embreeRenderSky(ray.dir);
+		return;
+	}
+
+	Embree.threadCounters[WorkerPool::getWorkerIndex()].shadedHits++;
+
+	// Store hit
+	int hitIndex = wavefront.hits.size();
+	wavefront.hits.push_back(Embree::WavefrontHit());
+	Embree::WavefrontHit& hit = wavefront.hits.back();
+	const EmbreeHitDecode& decode = Embree.frame.scene->Embree.getHit(ray.instID, ray.geomID);
+	hit.x = ray.x;
+	hit.y = ray.y;
+	hit.weight = ray.weight;
+	hit.diffuse = hit.specular = { 0.f };
+	hit.pos = Vec3(ray.org) + Vec3(ray.dir) * ray.tfar;
+	hit.material = decode.material;
+	hit.normal = Vec3::normalize(decode.getNormal(ray.primID, ray.u, ray.v));
+	hit.texture = decode.diffuse * decode.image->getPixel(decode.getTexCoord(ray.primID, ray.u, ray.v));
+	hit.transparency = 1.f - hit.texture.a();
+	hit.occluded = 0.f;
+
+	// Queue light rays
+	for (int l = 0; l < Embree.frame.scene->lights.size(); l++) {
+
+		Light& light = Embree.frame.scene->lights[l];
+
+		float distance = Vec3::length(light.position - hit.pos);
+		float attenuation = max(1.f - distance / light.range, 0.f);
+
+		// Light is in reach
+		if (attenuation > 0.f) {
+
+			Embree::WavefrontLightRay lRay;
+			lRay.incidence = Vec3::normalize(light.position - hit.pos);
+			lRay.org[0] = hit.pos.x();
+			lRay.org[1] = hit.pos.y();
+			lRay.org[2] = hit.pos.z();
+			lRay.dir[0] = lRay.incidence.x();
+			lRay.dir[1] = lRay.incidence.y();
+			lRay.dir[2] = lRay.incidence.z();
+			lRay.tnear = 0.01f;
+			lRay.tfar = distance;
+			lRay.instID =
+			lRay.geomID =
+			lRay.primID = RTC_INVALID_GEOMETRY_ID;
+			lRay.mask = EMBREE_RAY_VALID;
+			lRay.time = 0.f;
+			lRay.attenuation = attenuation;
+			lRay.hit = hitIndex;
+			lRay.light = l;
+			wavefront.shadowRays.push_back(lRay);
+
+		}
+
+	}
+
+	// Queue ambient occlusion rays
+	if (Embree.frame.enableAo) {
+
+		AoJitter jitter = embreeAoJitter(embreeAoNoise(ray.x, ray.y));
+		optix::Onb onb(optix::make_float3(hit.normal.x(), hit.normal.y(), hit.normal.z()));
+
+		// The wavefront always traces every sample
+		Embree::ThreadCounter& counter = Embree.threadCounters[WorkerPool::getWorkerIndex()];
+		counter.aoHits++;
+		counter.aoSamples += Embree.frame.aoSamples;
+
+		for (int a = 0; a < Embree.frame.aoSamples; a++) {
+
+			// Define sample vector
+			Vec3 sampleVector = embreeAoSample(a, jitter, onb);
+
+			// Define sample ray
+			Embree::WavefrontLightRay aoRay;
+			aoRay.org[0] = hit.pos.x();
+			aoRay.org[1] = hit.pos.y();
+			aoRay.org[2] = hit.pos.z();
+			aoRay.dir[0] = sampleVector.x();
+			aoRay.dir[1] = sampleVector.y();
+			aoRay.dir[2] = sampleVector.z();
+			aoRay.tnear = 0.01f;
+			aoRay.tfar = Embree.frame.scene->aoRadius;
+			aoRay.instID =
+			aoRay.geomID =
+			aoRay.primID = RTC_INVALID_GEOMETRY_ID;
+			aoRay.mask = EMBREE_RAY_VALID;
+			aoRay.time = 0.f;
+			aoRay.attenuation = 1.f;
+			aoRay.hit = hitIndex;
+			wavefront.aoRays.push_back(aoRay);
+
+		}
+
+	}
+
+	// Queue reflection ray
+	if (Embree.frame.enableReflections && hit.material->reflectIntensity > 0.f && ray.reflectDepth < Embree.frame.maxReflections) {
+
+		Vec3 reflDir = Vec3::reflect(-Vec3(ray.dir), hit.normal);
+
+		Embree::WavefrontRay rRay;
+		rRay.x = ray.x;
+		rRay.y = ray.y;
+		rRay.org[0] = hit.pos.x();
+		rRay.org[1] = hit.pos.y();
+		rRay.org[2] = hit.pos.z();
+		rRay.dir[0] = reflDir.x();
+		rRay.dir[1] = reflDir.y();
+		rRay.dir[2] = reflDir.z();
+		rRay.tnear = 0.01f;
+		rRay.tfar = FLT_MAX;
+		rRay.instID =
+		rRay.geomID =
+		rRay.primID = RTC_INVALID_GEOMETRY_ID;
+		rRay.mask = EMBREE_RAY_VALID;
+		rRay.time = 0.f;
+		rRay.weight = ray.weight * hit.material->reflectIntensity;
+		rRay.reflectDepth = ray.reflectDepth + 1;
+		rRay.refractDepth = ray.refractDepth;
+		wavefront.nextRays.push_back(rRay);
+
+	}
+
+	// Queue refraction ray
+	if (Embree.frame.enableRefractions && hit.transparency > 0.f && ray.refractDepth < Embree.frame.maxRefractions) {
+
+		Vec3 refrDir = Vec3::refract(ray.dir, hit.normal, hit.material->refractIndex);
+
+		Embree::WavefrontRay rRay;
+		rRay.x = ray.x;
+		rRay.y = ray.y;
+		rRay.org[0] = hit.pos.x();
+		rRay.org[1] = hit.pos.y();
+		rRay.org[2] = hit.pos.z();
+		rRay.dir[0] = refrDir.x();
+		rRay.dir[1] = refrDir.y();
+		rRay.dir[2] = refrDir.z();
+		rRay.tnear = 0.01f;
+		rRay.tfar = FLT_MAX;
+		rRay.instID =
+		rRay.geomID =
+		rRay.primID = RTC_INVALID_GEOMETRY_ID;
+		rRay.mask = EMBREE_RAY_VALID;
+		rRay.time = 0.f;
+		rRay.weight = ray.weight * hit.transparency;
+		rRay.reflectDepth = ray.reflectDepth;
+		rRay.refractDepth = ray.refractDepth + 1;
+		wavefront.nextRays.push_back(rRay);
+
+	}
+
+}
+
+// Intersects a queue of rays, N at a time
+template<int N>
+void RayEngine::embreeRenderWavefrontIntersect(vector<Embree::WavefrontRay>& rays) {
+
+	Embree::RayPacket<N> packet;
+
+	for (uint start = 0; start < rays.size(); start += N) {
+
+		for (int i = 0; i < N; i++) {
+
+			if (start + i >= rays.size()) {
+				packet.valid[i] = EMBREE_RAY_INVALID;
+				continue;
+			}
+
+			Embree::WavefrontRay& ray = rays[start + i];
+			packet.valid[i] = EMBREE_RAY_VALID;
+			packet.orgx[i] = ray.org[0];
+			packet.orgy[i] = ray.org[1];
+			packet.orgz[i] = ray.org[2];
+			packet.dirx[i] = ray.dir[0];
+			packet.diry[i] = ray.dir[1];
+			packet.dirz[i] = ray.dir[2];
+			packet.tnear[i] = ray.tnear;
+			packet.tfar[i] = ray.tfar;
+			packet.instID[i] =
+			packet.geomID[i] =
+			packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+			packet.mask[i] = ray.mask;
+			packet.time[i] = ray.time;
+
+		}
+
+		EmbreePacket<N>::intersect(packet.valid, Embree.frame.scene->Embree.scene, packet);
+
+		for (int i = 0; i < N && start + i < rays.size(); i++) {
+
+			Embree::WavefrontRay& ray = rays[start + i];
+			ray.tfar = packet.tfar[i];
+			ray.instID = packet.instID[i];
+			ray.geomID = packet.geomID[i];
+			ray.primID = packet.primID[i];
+			ray.u = packet.u[i];
+			ray.v = packet.v[i];
+
+		}
+
+	}
+
+}
+
+// Tests a queue of light rays for occlusion, N at a time
+template<int N>
+void RayEngine::embreeRenderWavefrontOccluded(vector<Embree::WavefrontLightRay>& rays) {
+
+	Embree::LightRayPacket<N> packet;
+
+	for (uint start = 0; start < rays.size(); start += N) {
+
+		for (int i = 0; i < N; i++) {
+
+			if (start + i >= rays.size()) {
+				packet.valid[i] = EMBREE_RAY_INVALID;
+				continue;
+			}
+
+			Embree::WavefrontLightRay& ray = rays[start + i];
+			packet.valid[i] = EMBREE_RAY_VALID;
+			packet.attenuation[i] = ray.attenuation;
+			packet.orgx[i] = ray.org[0];
+			packet.orgy[i] = ray.org[1];
+			packet.orgz[i] = ray.org[2];
+			packet.dirx[i] = ray.dir[0];
+			packet.diry[i] = ray.dir[1];
+			packet.dirz[i] = ray.dir[2];
+			packet.tnear[i] = ray.tnear;
+			packet.tfar[i] = ray.tfar;
+			packet.instID[i] =
+			packet.geomID[i] =
+			packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+			packet.mask[i] = ray.mask;
+			packet.time[i] = ray.time;
+
+		}
+
+		embreeOccludedPacket(packet);
+
+		for (int i = 0; i < N && start + i < rays.size(); i++)
+			rays[start + i].attenuation = packet.attenuation[i];
+
+	}
+
+}
+
+// Gathers the shadow rays of the queue by light and traces each light's rays as packets. Rays
+// toward one light converge, so a packet is only split into single rays when its directions
+// spread wider than EMBREE_SHADOW_SPREAD_COS (for rays from far apart hits).
+template<int N>
+void RayEngine::embreeRenderWavefrontShadows(Embree::Wavefront& wavefront) {
+
+	vector<Embree::WavefrontLightRay>& rays = wavefront.shadowRays;
+	vector<Embree::WavefrontLightRay>& gathered = wavefront.binnedLightRays;
+	uint numLights = Embree.frame.scene->lights.size();
+
+	if (wavefront.shadowCount.size() < numLights) {
+		wavefront.shadowCount.resize(numLights, 0);
+		wavefront.shadowSingleCount.resize(numLights, 0);
+		wavefront.shadowTime.resize(numLights, 0.0);
+	}
+
+	// Gather by light, keeping the (binned) order within each light
+	wavefront.binStarts.assign(numLights + 1, 0);
+	for (uint r = 0; r < rays.size(); r++)
+		wavefront.binStarts[rays[r].light + 1]++;
+	for (uint l = 0; l < numLights; l++)
+		wavefront.binStarts[l + 1] += wavefront.binStarts[l];
+
+	gathered.resize(rays.size());
+	for (uint r = 0; r < rays.size(); r++)
+		gathered[wavefront.binStarts[rays[r].light]++] = rays[r];
+	swap(rays, gathered);
+
+	// Trace each light's rays
+	Embree::LightRayPacket<N> packet;
+	uint end = 0;
+
+	for (uint l = 0; l < numLights; l++) {
+
+		uint start = end;
+		end = wavefront.binStarts[l];
+		double startTime = WorkerPool::getSeconds();
+
+		for (uint p = start; p < end; p += N) {
+
+			int count = min(end - p, (uint)N);
+
+			// Find the spread of the directions
+			Vec3 mean = { 0.f };
+			for (int i = 0; i < count; i++)
+				mean += rays[p + i].incidence;
+			mean = Vec3::normalize(mean);
+
+			float minCos = 1.f;
+			for (int i = 0; i < count; i++)
+				minCos = min(minCos, Vec3::dot(mean, rays[p + i].incidence));
+
+			// Too divergent, trace single rays
+			if (minCos < EMBREE_SHADOW_SPREAD_COS) {
+				for (int i = 0; i < count; i++)
+					embreeOccluded(rays[p + i]);
+				wavefront.shadowSingleCount[l] += count;
+				continue;
+			}
+
+			for (int i = 0; i < N; i++) {
+
+				if (i >= count) {
+					packet.valid[i] = EMBREE_RAY_INVALID;
+					continue;
+				}
+
+				Embree::WavefrontLightRay& ray = rays[p + i];
+				packet.valid[i] = EMBREE_RAY_VALID;
+				packet.attenuation[i] = ray.attenuation;
+				packet.orgx[i] = ray.org[0];
+				packet.orgy[i] = ray.org[1];
+				packet.orgz[i] = ray.org[2];
+				packet.dirx[i] = ray.dir[0];
+				packet.diry[i] = ray.dir[1];
+				packet.dirz[i] = ray.dir[2];
+				packet.tnear[i] = ray.tnear;
+				packet.tfar[i] = ray.tfar;
+				packet.instID[i] =
+				packet.geomID[i] =
+				packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+				packet.mask[i] = ray.mask;
+				packet.time[i] = ray.time;
+
+			}
+
+			embreeOccludedPacket(packet);
+
+			for (int i = 0; i < count; i++)
+				rays[p + i].attenuation = packet.attenuation[i];
+
+		}
+
+		wavefront.shadowCount[l] += end - start;
+		wavefront.shadowTime[l] += WorkerPool::getSeconds() - startTime;
+
+	}
+
+}
+
+// Sorts a queue of rays by direction octant, then by origin cell along a Morton curve,
+// so that consecutive rays (and thereby the packets built from them) are coherent
+template<typename T>
+void RayEngine::embreeRenderWavefrontBin(vector<T>& rays, vector<T>& binned, Embree::Wavefront& wavefront) {
+
+	const int cells = 1 << EMBREE_BIN_CELLS_BITS;
+	const uint numBins = 8 * cells * cells * cells;
+
+	if ((int)rays.size() <= Embree.frame.packetWidth)
+		return;
+
+	// Find origin bounds
+	Vec3 orgMin = Vec3(rays[0].org), orgMax = orgMin;
+	for (uint r = 1; r < rays.size(); r++) {
+		orgMin = Vec3(min(orgMin.x(), rays[r].org[0]), min(orgMin.y(), rays[r].org[1]), min(orgMin.z(), rays[r].org[2]));
+		orgMax = Vec3(max(orgMax.x(), rays[r].org[0]), max(orgMax.y(), rays[r].org[1]), max(orgMax.z(), rays[r].org[2]));
+	}
+	Vec3 extent = orgMax - orgMin;
+	Vec3 cellScale = Vec3(
+		extent.x() > 0.f ? cells / extent.x() : 0.f,
+		extent.y() > 0.f ? cells / extent.y() : 0.f,
+		extent.z() > 0.f ? cells / extent.z() : 0.f
+	);
+
+	// Compute keys and count the rays in each bin
+	wavefront.binKeys.resize(rays.size());
+	wavefront.binStarts.assign(numBins + 1, 0);
+	for (uint r = 0; r < rays.size(); r++) {
+
+		T& ray = rays[r];
+		uint octant = (ray.dir[0] < 0.f) | ((ray.dir[1] < 0.f) << 1) | ((ray.dir[2] < 0.f) << 2);
+		uint cx = min((int)((ray.org[0] - orgMin.x()) * cellScale.x()), cells - 1);
+		uint cy = min((int)((ray.org[1] - orgMin.y()) * cellScale.y()), cells - 1);
+		uint cz = min((int)((ray.org[2] - orgMin.z()) * cellScale.z()), cells - 1);
+
+		uint cell = 0;
+		for (int b = 0; b < EMBREE_BIN_CELLS_BITS; b++)
+			cell |= (((cx >> b) & 1) << (3 * b)) | (((cy >> b) & 1) << (3 * b + 1)) | (((cz >> b) & 1) << (3 * b + 2));
+
+		uint key = (octant << (3 * EMBREE_BIN_CELLS_BITS)) | cell;
+		wavefront.binKeys[r] = key;
+		wavefront.binStarts[key + 1]++;
+
+	}
+
+	// Counting sort into the binned queue
+	for (uint b = 0; b < numBins; b++)
+		wavefront.binStarts[b + 1] += wavefront.binStarts[b];
+
+	binned.resize(rays.size());
+	for (uint r = 0; r < rays.size(); r++)
+		binned[wavefront.binStarts[wavefront.binKeys[r]]++] = rays[r];
+
+	swap(rays, binned);
+
+}
+
+template void RayEngine::embreeRenderWavefrontIntersect<4>(vector<Embree::WavefrontRay>& rays);
+template void RayEngine::embreeRenderWavefrontIntersect<8>(vector<Embree::WavefrontRay>& rays);
+template void RayEngine::embreeRenderWavefrontIntersect<16>(vector<Embree::WavefrontRay>& rays);
+template void RayEngine::embreeRenderWavefrontOccluded<4>(vector<Embree::WavefrontLightRay>& rays);
+template void RayEngine::embreeRenderWavefrontOccluded<8>(vector<Embree::WavefrontLightRay>& rays);
+template void RayEngine::embreeRenderWavefrontOccluded<16>(vector<Embree::WavefrontLightRay>& rays);
+template void RayEngine::embreeRenderWavefrontShadows<4>(Embree::Wavefront& wavefront);
+template void RayEngine::embreeRenderWavefrontShadows<8>(Embree::Wavefront& wavefront);
+template void RayEngine::embreeRenderWavefrontShadows<16>(Embree::Wavefront& wavefront);
\ No newline at end of file
@@ -2,6 +2,9 @@
 
 void RayEngine::guiRender() {
 
+	if (renderMode == RM_EMBREE || renderMode == RM_HYBRID)
+		embreeRenderTileOverlay();
+
 	if (showGui) {
 		for (Setting* s : settings)
 			s->visible = false;
@@ -23,7 +26,43 @@ void RayEngine::guiRender() {
 		// Embree average time
 		if (renderMode == RM_EMBREE || renderMode == RM_HYBRID) {
 			guiRenderText("Embree avg render:", dx, dy);
-			guiRenderText(to_string_prec(Embree.renderTimer.avgTime, 4) + " s", dx + 150, dy); dy += 16;
+			guiRenderText(to_string_prec(Embree.displayStats.avgRenderTime, 4) + " s", dx + 150, dy); dy += 16;
+			guiRenderText("Embree filter calls:", dx, dy);
+			guiRenderText(to_string(Embree.displayStats.filterCalls), dx + 150, dy); dy += 16;
+			if (enableAo) {
+				guiRenderText("Embree AO samples/hit:", dx, dy);
+				guiRenderText(to_string_prec(Embree.displayStats.aoSamplesPerHit, 2), dx + 150, dy); dy += 16;
+			}
+			guiRenderText("Embree tail:", dx, dy);
+			guiRenderText(to_string_prec(Embree.displayStats.tailTime, 4) + " s", dx + 150, dy); dy += 16;
+			guiRenderText("Embree resolve:", dx, dy);
+			guiRenderText(to_string_prec(Embree.displayStats.resolveTime, 4) + " s", dx + 150, dy); dy += 16;
+			if (Embree.enableTiles && Embree.enableBudget) {
+				guiRenderText("Embree skipped tiles:", dx, dy);
+				guiRenderText(to_string(Embree.displayStats.skippedTiles) + " / " + to_string(Embree.displayStats.tileTasks.size()), dx + 150, dy); dy += 16;
+			}
+			if (renderMode == RM_EMBREE && Embree.enableDynamicResolution) {
+				guiRenderText("Embree scale:", dx, dy);
+				guiRenderText(to_string_prec(Embree.displayFrame.scale, 2) + " (" + to_string(Embree.displayFrame.width) + "x" + to_string(Embree.displayFrame.height) + ")", dx + 150, dy); dy += 16;
+			}
+			if (enableAo && enableAoCache) {
+				guiRenderText("Embree AO cache:", dx, dy);
+				guiRenderText(to_string(Embree.displayStats.aoCacheCells) + " cells", dx + 150, dy); dy += 16;
+			}
+			if (Embree.enableCheckerboard) {
+				guiRenderText("Embree checker reuse:", dx, dy);
+				guiRenderText(to_string_prec(Embree.displayStats.checkerReuse * 100.f, 1) + " %", dx + 150, dy); dy += 16;
+			}
+			if (Embree.enableCache) {
+				guiRenderText("Embree cache hits:", dx, dy);
+				guiRenderText(to_string_prec(Embree.displayStats.cacheHitRate * 100.f, 1) + " %", dx + 150, dy); dy += 16;
+			}
+			if (renderMode == RM_EMBREE && Embree.enableProgressive) {
+				guiRenderText("Embree accumulated:", dx, dy);
+				guiRenderText(to_string(Embree.displayStats.accumulatedFrames) + " frames", dx + 150, dy); dy += 16;
+			}
+			guiRenderText("Embree idle/steals:", dx, dy);
+			guiRenderText(to_string_prec(Embree.displayStats.idleTime, 4) + " s / " + to_string(Embree.displayStats.steals), dx + 150, dy); dy += 16;
 			//guiRenderText("Embree avg texture:", dx, dy);
 			//guiRenderText(to_string_prec(Embree.textureTimer.avgTime, 4) + " s", dx + 150, dy); dy += 16;
 		}
@@ -75,6 +114,10 @@ void RayEngine::guiRender() {
 			guiRenderSetting(settingEnableAo, dx, dy);
 			if (enableAo) {
 				guiRenderSetting(settingAoSamples, dx, dy, true);
+				guiRenderSetting(settingAoEnableAdaptive, dx, dy, true);
+				guiRenderSetting(settingAoEnableCache, dx, dy, true);
+				if (enableAoCache)
+					guiRenderSetting(settingAoCacheCell, dx, dy, true);
 				guiRenderSetting(settingAoRadius, dx, dy, true);
 				guiRenderSetting(settingAoPower, dx, dy, true);
 				guiRenderSetting(settingAoNoiseScale, dx, dy, true);
@@ -84,14 +127,42 @@ void RayEngine::guiRender() {
 			// Embree
 			if (renderMode == RM_EMBREE || renderMode == RM_HYBRID) {
 				guiRenderSetting(settingEmbreeNumThreads, dx, dy);
+				if (numaGetNumNodes() > 1) {
+					guiRenderSetting(settingEmbreeEnableNuma, dx, dy, true);
+					if (Embree.enableNuma)
+						guiRenderSetting(settingEmbreeEnableNumaReplication, dx, dy, true);
+				}
 				guiRenderSetting(settingEmbreeEnableTiles, dx, dy);
 				if (Embree.enableTiles) {
 					guiRenderSetting(settingEmbreeTileWidth, dx, dy, true);
 					guiRenderSetting(settingEmbreeTileHeight, dx, dy, true);
+					guiRenderSetting(settingEmbreeEnableCostScheduling, dx, dy, true);
+					guiRenderSetting(settingEmbreeEnableAdaptiveTiles, dx, dy, true);
+					guiRenderSetting(settingEmbreeDisplayTiles, dx, dy, true);
+					guiRenderSetting(settingEmbreeEnableBudget, dx, dy, true);
+					if (Embree.enableBudget) {
+						guiRenderSetting(settingEmbreeBudget, dx, dy, true);
+						guiRenderSetting(settingEmbreeBudgetAtCursor, dx, dy, true);
+					}
+				}
+				guiRenderSetting(settingEmbreePacketWidth, dx, dy);
+				if (renderMode == RM_EMBREE) {
+					guiRenderSetting(settingEmbreeFrameMode, dx, dy);
+					guiRenderSetting(settingEmbreeEnableDynamicResolution, dx, dy);
+					if (Embree.enableDynamicResolution)
+						guiRenderSetting(settingEmbreeTargetTime, dx, dy, true);
+					guiRenderSetting(settingEmbreeEnableProgressive, dx, dy);
+				}
+				guiRenderSetting(settingEmbreeEnableCache, dx, dy);
+				guiRenderSetting(settingEmbreeEnableCheckerboard, dx, dy);
+				guiRenderSetting(settingEmbreeEnableWavefront, dx, dy);
+				if (Embree.enableWavefront)
+					guiRenderSetting(settingEmbreeEnableBinning, dx, dy, true);
+				else {
+					guiRenderSetting(settingEmbreeEnablePacketsPrimary, dx, dy);
+					if (Embree.enablePacketsPrimary)
+						guiRenderSetting(settingEmbreeEnablePacketsSecondary, dx, dy, true);
 				}
-				guiRenderSetting(settingEmbreeEnablePacketsPrimary, dx, dy);
-				if (Embree.enablePacketsPrimary)
-					guiRenderSetting(settingEmbreeEnablePacketsSecondary, dx, dy, true);
 				dy += 8;
 			}
 
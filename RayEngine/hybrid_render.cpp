@@ -1,27 +1,23 @@
 #include "rayengine.h"
-#include <omp.h>
 
-void RayEngine::hybridRender() {
+void RayEngine::hybridRender(const FrameState& frame) {
 
 	Hybrid.renderTimer.start();
 
 	if (Hybrid.enableThreaded) {
 
-		omp_set_nested(true);
-		#pragma omp parallel num_threads(2)
-		{
-			if (omp_get_thread_num() == 0)
-				optixRender();
-			else
-				embreeRender();
-		}
+		// The render thread hands Embree's tiles to the pool, while this one mostly waits for the GPU
+		embreeRequestFrame(frame);
+		optixRender(frame);
+		embreeTakeFrame(true);
 		embreeRenderUpdateTexture();
 		optixRenderUpdateTexture();
 
 	} else {
 
-		optixRender();
-		embreeRender();
+		optixRender(frame);
+		embreeRender(frame);
+		embreeRenderPresent();
 		embreeRenderUpdateTexture();
 		optixRenderUpdateTexture();
 
@@ -62,6 +62,7 @@ Image::Image(GLuint filter, string filename, string alphaFilename) :
 
 	}
 
+	findOpacity();
 	createTexture();
 
 }
@@ -72,6 +73,7 @@ Image::Image(Color color) {
 	pixels = new Color[1];
 	pixels[0] = color;
 	filter = GL_NEAREST;
+	findOpacity();
 	createTexture();
 
 }
@@ -82,9 +84,23 @@ Image::Image(Color* pixels, int width, int height, GLuint filter) :
 	height(height),
 	filter(filter)
 {
+	findOpacity();
 	createTexture();
 }
 
+void Image::findOpacity() {
+
+	opacity = OP_OPAQUE;
+
+	for (int i = 0; i < width * height; i++) {
+		float alpha = pixels[i].a();
+		if (alpha > 0.f && alpha < 1.f)
+			opacity = OP_TRANSLUCENT;
+		else if (alpha == 0.f && opacity == OP_OPAQUE)
+			opacity = OP_ALPHA_TESTED;
+	}
+
+}
 
 void Image::createTexture() {
 
@@ -7,6 +7,13 @@
 #include "GL/glew.h"
 #include <Magick++.h>
 
+// How much of an image can be seen through
+enum Opacity {
+	OP_OPAQUE,			// Every pixel is solid
+	OP_ALPHA_TESTED,	// Every pixel is either solid or fully transparent
+	OP_TRANSLUCENT		// Some pixels are partially transparent
+};
+
 struct Image {
 
 	// Create an image from a file.
@@ -21,6 +28,9 @@ struct Image {
 	// Creates an OpenGL texture object.
 	void createTexture();
 
+	// Classifies the alpha channel of the pixels.
+	void findOpacity();
+
 	// Gets the color of a pixel.
 	Color getPixel(Vec2 coord);
 	Color getPixel(int x, int y);
@@ -30,5 +40,6 @@ struct Image {
 	int width, height;
 	GLuint texture;
 	GLuint filter;
+	Opacity opacity;
 
 };
\ No newline at end of file
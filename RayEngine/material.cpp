@@ -9,4 +9,13 @@ Material::Material() :
 	refractIndex(1.f)
 {
 	Optix.material = nullptr;
+}
+
+Opacity Material::getOpacity() {
+
+	if (diffuse.a() < 1.f)
+		return OP_TRANSLUCENT;
+
+	return image->opacity;
+
 }
\ No newline at end of file
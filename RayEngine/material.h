@@ -8,6 +8,9 @@ struct Material {
 
 	Material();
 
+	// Combines the opacity of the diffuse color and image.
+	Opacity getOpacity();
+
 	Color ambient, specular, diffuse;
 	float shineExponent, reflectIntensity, refractIndex;
 	Image* image;
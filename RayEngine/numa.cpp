@@ -0,0 +1,74 @@
+#include "numa.h"
+
+#include <windows.h>
+
+// OS node numbers of the nodes with processors
+static vector<int> getNodes() {
+
+	vector<int> nodes;
+	ULONG highest = 0;
+
+	if (GetNumaHighestNodeNumber(&highest)) {
+		for (ULONG n = 0; n <= highest; n++) {
+			GROUP_AFFINITY affinity = {};
+			if (GetNumaNodeProcessorMaskEx((USHORT)n, &affinity) && affinity.Mask)
+				nodes.push_back(n);
+		}
+	}
+
+	if (nodes.empty())
+		nodes.push_back(0);
+
+	return nodes;
+
+}
+
+static const vector<int>& nodes() {
+	static vector<int> nodes = getNodes();
+	return nodes;
+}
+
+int numaGetNumNodes() {
+	return nodes().size();
+}
+
+bool numaPinThread(int node, NumaAffinity* previous) {
+
+	GROUP_AFFINITY affinity = {}, prevAffinity = {};
+	if (!GetNumaNodeProcessorMaskEx((USHORT)nodes()[node % nodes().size()], &affinity) ||
+		!SetThreadGroupAffinity(GetCurrentThread(), &affinity, &prevAffinity))
+		return false;
+
+	if (previous) {
+		previous->mask = prevAffinity.Mask;
+		previous->group = prevAffinity.Group;
+	}
+	return true;
+
+}
+
+void numaRestoreThread(const NumaAffinity& affinity) {
+
+	GROUP_AFFINITY prevAffinity = {};
+	prevAffinity.Mask = (KAFFINITY)affinity.mask;
+	prevAffinity.Group = affinity.group;
+	SetThreadGroupAffinity(GetCurrentThread(), &prevAffinity, NULL);
+
+}
+
+void* numaReserve(size_t size) {
+	return VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE, PAGE_READWRITE, nodes()[0]);
+}
+
+void numaCommit(void* memory, size_t size, int node) {
+	VirtualAllocExNuma(GetCurrentProcess(), memory, size, MEM_COMMIT, PAGE_READWRITE, nodes()[node % nodes().size()]);
+}
+
+void* numaAlloc(size_t size, int node) {
+	return VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, nodes()[node % nodes().size()]);
+}
+
+void numaFree(void* memory) {
+	if (memory)
+		VirtualFree(memory, 0, MEM_RELEASE);
+}
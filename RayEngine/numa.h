@@ -0,0 +1,66 @@
+#pragma once
+
+#include "util.h"
+
+// NUMA nodes are numbered 0 to numaGetNumNodes() - 1, counting only the nodes with processors.
+int numaGetNumNodes();
+
+// Processor affinity of a thread, as saved by numaPinThread.
+struct NumaAffinity {
+	unsigned long long mask;
+	unsigned short group;
+};
+
+// Pins the calling thread to the processors of a node. If previous is given, the affinity
+// the thread had is stored there for numaRestoreThread. Returns false if it wasn't pinned.
+bool numaPinThread(int node, NumaAffinity* previous = nullptr);
+
+// Gives the calling thread back an affinity saved by numaPinThread.
+void numaRestoreThread(const NumaAffinity& affinity);
+
+// Reserves address space, committed in parts with numaCommit.
+void* numaReserve(size_t size);
+
+// Commits memory whose pages will be placed on a node when first touched.
+void numaCommit(void* memory, size_t size, int node);
+
+// Reserves and commits memory on a node, released with numaFree.
+void* numaAlloc(size_t size, int node);
+void numaFree(void* memory);
+
+// Array stored in contiguous bands, each on its own node. Band n starts at element bandStarts[n].
+template<typename T> struct NumaArray {
+
+	T* data;
+	size_t count;
+	vector<size_t> bandStarts;
+
+	NumaArray() : data(nullptr), count(0) {}
+	~NumaArray() { numaFree(data); }
+
+	// Reallocates the array if the size or bands changed, the new elements are zero
+	void resize(size_t count, const vector<size_t>& bandStarts) {
+
+		if (data && count == this->count && bandStarts == this->bandStarts)
+			return;
+
+		numaFree(data);
+		this->count = count;
+		this->bandStarts = bandStarts;
+		data = (T*)numaReserve(max(count, (size_t)1) * sizeof(T));
+
+		for (size_t n = 0; n < bandStarts.size(); n++) {
+			size_t end = (n + 1 < bandStarts.size()) ? bandStarts[n + 1] : count;
+			if (end > bandStarts[n])
+				numaCommit(data + bandStarts[n], (end - bandStarts[n]) * sizeof(T), n);
+		}
+
+	}
+
+	size_t size() const { return count; }
+	T* begin() { return data; }
+	T* end() { return data + count; }
+	__forceinline T& operator[](size_t i) { return data[i]; }
+	__forceinline const T& operator[](size_t i) const { return data[i]; }
+
+};
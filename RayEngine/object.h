@@ -8,6 +8,8 @@
 #include "material.h"
 #include "triangle_mesh.h"
 
+struct WorkerPool;
+
 struct Object {
 
 	// Constructor
@@ -35,7 +37,7 @@ struct Object {
 		RTCScene scene;
 		map<uint, Geometry*> geomIDmap;
 	} Embree;
-	void embreeInit(RTCDevice device);
+	void embreeInit(RTCDevice device, WorkerPool& pool);
 
 	// OptiX
 	struct Optix{
@@ -1,27 +1,27 @@
 #include "rayengine.h"
 
-void RayEngine::optixRender() {
+void RayEngine::optixRender(const FrameState& frame) {
 
 	if (!OPTIX_ENABLE || Optix.width == 0 || (renderMode == RM_HYBRID && !Hybrid.enableOptix))
 		return;
 
 	try {
 
-		Optix.context["org"]->setFloat(rayOrg.x(), rayOrg.y(), rayOrg.z());
-		Optix.context["xaxis"]->setFloat(rayXaxis.x(), rayXaxis.y(), rayXaxis.z());
-		Optix.context["yaxis"]->setFloat(rayYaxis.x(), rayYaxis.y(), rayYaxis.z());
-		Optix.context["zaxis"]->setFloat(rayZaxis.x(), rayZaxis.y(), rayZaxis.z());
+		Optix.context["org"]->setFloat(frame.rayOrg.x(), frame.rayOrg.y(), frame.rayOrg.z());
+		Optix.context["xaxis"]->setFloat(frame.rayXaxis.x(), frame.rayXaxis.y(), frame.rayXaxis.z());
+		Optix.context["yaxis"]->setFloat(frame.rayYaxis.x(), frame.rayYaxis.y(), frame.rayYaxis.z());
+		Optix.context["zaxis"]->setFloat(frame.rayZaxis.x(), frame.rayZaxis.y(), frame.rayZaxis.z());
 		Optix.context["offset"]->setFloat(Optix.offset);
-		Optix.context["enableReflections"]->setInt(enableReflections);
-		Optix.context["maxReflections"]->setInt(maxReflections);
-		Optix.context["enableRefractions"]->setInt(enableRefractions);
-		Optix.context["maxRefractions"]->setInt(maxRefractions);
-		Optix.context["enableAo"]->setInt(enableAo);
-		Optix.context["aoSamples"]->setInt(aoSamples);
-		Optix.context["aoSamplesSqrt"]->setInt(aoSamplesSqrt);
-		Optix.context["aoNoiseScale"]->setFloat(aoNoiseScale);
-		Optix.context["aoPower"]->setFloat(aoPower);
-		Optix.context["aoRadius"]->setFloat(curScene->aoRadius);
+		Optix.context["enableReflections"]->setInt(frame.enableReflections);
+		Optix.context["maxReflections"]->setInt(frame.maxReflections);
+		Optix.context["enableRefractions"]->setInt(frame.enableRefractions);
+		Optix.context["maxRefractions"]->setInt(frame.maxRefractions);
+		Optix.context["enableAo"]->setInt(frame.enableAo);
+		Optix.context["aoSamples"]->setInt(frame.aoSamples);
+		Optix.context["aoSamplesSqrt"]->setInt(frame.aoSamplesSqrt);
+		Optix.context["aoNoiseScale"]->setFloat(frame.aoNoiseScale);
+		Optix.context["aoPower"]->setFloat(frame.aoPower);
+		Optix.context["aoRadius"]->setFloat(frame.scene->aoRadius);
 
 		if (Optix.enableProgressive) {
 
@@ -31,7 +31,7 @@ void RayEngine::optixRender() {
 			// to accurately measure the time taken for progressive rendering.
 
 			Optix.context["renderBuffer"]->set(Optix.streamRenderBuffer);
-			Optix.context->launchProgressive(0, window.width, window.height, 1);
+			Optix.context->launchProgressive(0, frame.width, frame.height, 1);
 
 		} else {
 
@@ -40,7 +40,7 @@ void RayEngine::optixRender() {
 			Optix.renderTimer.start();
 
 			Optix.context["renderBuffer"]->set(Optix.renderBuffer);
-			Optix.context->launch(0, window.width, window.height);
+			Optix.context->launch(0, frame.width, frame.height);
 			
 			Optix.renderTimer.stop();
 
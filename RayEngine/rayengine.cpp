@@ -21,11 +21,16 @@ RayEngine::RayEngine() {
 	OpenGL.shdrPhong = new Shader("Phong", bind(&RayEngine::openglSetupPhong, this, _1, _2, _3), "phong.vshader", "phong.fshader");
 
 	benchmarkMode = false;
+	curScene = nullptr;
+	lastFrame.view = 0;
+	lastFrame.number = 0;
+	lastView = 0;
 
 }
 
 RayEngine::~RayEngine() {
 	
+	embreeStopRenderThread();
 	logClose();
 
 }
@@ -57,11 +62,10 @@ void RayEngine::loop() {
 	settingsInput();
 	if (enableCameraPath)
 		curScene->updateCameraPath(benchmarkMode);
-	
-	rayOrg = curCamera->position;
-	rayXaxis = curCamera->xaxis * window.ratio * curCamera->tFov;
-	rayYaxis = -curCamera->yaxis * curCamera->tFov;
-	rayZaxis = curCamera->zaxis;
+
+	// Nothing the frame is rendered with changes until the next loop
+	FrameState frame = frameBuild();
+	frameAdvance(frame);
 
 	if (renderMode == RM_OPENGL) {
 
@@ -69,17 +73,39 @@ void RayEngine::loop() {
 
 	} else if (renderMode == RM_EMBREE) {
 
-		embreeRender();
-		embreeRenderUpdateTexture();
+		// Benchmarks time every frame, so they render in turn
+		FrameMode frameMode = benchmarkMode ? FM_SERIAL : Embree.frameMode;
+
+		if (frameMode == FM_RENDER_THREAD) {
+
+			// Post this frame and show the newest one the render thread finished
+			embreeRequestFrame(frame);
+			embreeTakeFrame();
+			embreeRenderUpdateTexture();
+
+		} else if (frameMode == FM_PIPELINED) {
+
+			// Trace this frame on the render thread while the last one is uploaded, it's displayed in the next loop
+			embreeRequestFrame(frame);
+			embreeRenderUpdateTexture();
+			embreeTakeFrame(true);
+
+		} else {
+
+			embreeRender(frame);
+			embreeRenderPresent();
+			embreeRenderUpdateTexture();
+
+		}
 
 	} else if (renderMode == RM_OPTIX) {
 
-		optixRender();
+		optixRender(frame);
 		optixRenderUpdateTexture();
 
 	} else if (renderMode == RM_HYBRID) {
 
-		hybridRender();
+		hybridRender(frame);
 		hybridRenderUpdatePartition();
 
 	}
@@ -93,8 +119,125 @@ void RayEngine::loop() {
 
 }
 
+// Returns an element of the Halton sequence of a base, in [0, 1)
+static float halton(int index, int base) {
+
+	float result = 0.f, f = 1.f;
+	while (index > 0) {
+		f /= base;
+		result += f * (index % base);
+		index /= base;
+	}
+	return result;
+
+}
+
+// Takes the snapshot of the camera, window and settings that the render paths read
+RayEngine::FrameState RayEngine::frameBuild() {
+
+	FrameState frame;
+	frame.scene = curScene;
+
+	// Only Embree frames are scaled, the partitions of the hybrid renderer are left as they are
+	frame.scale = (renderMode == RM_EMBREE && Embree.enableDynamicResolution) ? Embree.scale : 1.f;
+	frame.width = frameScaleSize(window.width, frame.scale);
+	frame.height = frameScaleSize(window.height, frame.scale);
+	frame.windowWidth = window.width;
+	frame.windowHeight = window.height;
+	frame.embreeOffset = Embree.offset;
+	frame.embreeWidth = (frame.scale < 1.f) ? frame.width : Embree.width;
+
+	frame.rayOrg = curCamera->position;
+	frame.rayXaxis = curCamera->xaxis * window.ratio * curCamera->tFov;
+	frame.rayYaxis = -curCamera->yaxis * curCamera->tFov;
+	frame.rayZaxis = curCamera->zaxis;
+	frame.enableReflections = enableReflections;
+	frame.maxReflections = maxReflections;
+	frame.enableRefractions = enableRefractions;
+	frame.maxRefractions = maxRefractions;
+	frame.enableAo = enableAo;
+	frame.enableAdaptiveAo = enableAdaptiveAo;
+	frame.enableAoCache = enableAoCache;
+	frame.aoCacheCell = curScene->aoRadius * aoCacheCell;
+	frame.aoSamples = aoSamples;
+	frame.aoSamplesSqrt = aoSamplesSqrt;
+	frame.aoPower = aoPower;
+	frame.aoNoiseScale = aoNoiseScale;
+	frame.focusX = Embree.budgetAtCursor ? window.mouse.x() * frame.scale : frame.embreeOffset + frame.embreeWidth * 0.5f;
+	frame.focusY = Embree.budgetAtCursor ? window.mouse.y() * frame.scale : frame.height * 0.5f;
+	frame.aoTable = Embree.aoTable;
+
+	frame.enableTiles = Embree.enableTiles;
+	frame.enableCostScheduling = Embree.enableCostScheduling;
+	frame.enableAdaptiveTiles = Embree.enableAdaptiveTiles;
+	frame.enableWavefront = Embree.enableWavefront;
+	frame.enablePacketsPrimary = Embree.enablePacketsPrimary;
+	frame.enablePacketsSecondary = Embree.enablePacketsSecondary;
+	frame.enableBinning = Embree.enableBinning;
+	frame.enableBudget = Embree.enableBudget;
+	frame.tileWidth = Embree.tileWidth;
+	frame.tileHeight = Embree.tileHeight;
+	frame.packetWidth = Embree.packetWidth;
+	frame.budgetMs = Embree.budgetMs;
+
+	// The frame stands alone until frameAdvance numbers it among the loop's frames, so the frames of
+	// screenshots and benchmarks aren't accumulated, don't reuse the cache and have the plain jitter and noise
+	frame.view = frame.sample = 0;
+	frame.number = 0;
+	frame.enableCache = Embree.enableCache && !frame.enableWavefront && !(frame.enablePacketsPrimary && frame.enablePacketsSecondary);
+	frame.traceFeatures = Embree.traceFeatures | (frame.enableCache ? TF_CACHE : 0);
+	frame.enableCheckerboard = Embree.enableCheckerboard;
+	frame.checkerParity = 0;
+	frame.jitterX = frame.jitterY = 0.f;
+	frame.aoShiftR = frame.aoShiftG = 0.f;
+
+	return frame;
+
+}
+
+// Numbers a frame of the loop after the last one. Only the loop calls this, so screenshots and
+// benchmarks leave the progressive accumulation and the temporal cache of the loop as they were.
+void RayEngine::frameAdvance(FrameState& frame) {
+
+	// An unchanged view keeps its number and takes the next sample, a changed one starts a new view.
+	// Benchmarks time single frames, so they don't accumulate.
+	if (renderMode == RM_EMBREE && Embree.enableProgressive && !benchmarkMode) {
+		if (lastFrame.view && frameSameView(frame, lastFrame)) {
+			frame.view = lastFrame.view;
+			frame.sample = lastFrame.sample + 1;
+		} else
+			frame.view = ++lastView;
+	}
+
+	frame.number = lastFrame.number + 1;
+
+	// The first sample is at the pixel corners with the plain noise, the next are spread by Halton sequences.
+	// Without accumulation the cache rotates the AO strata every frame instead, so its blend sees new samples.
+	frame.jitterX = halton(frame.sample, 2);
+	frame.jitterY = halton(frame.sample, 3);
+	int aoShift = (!frame.view && frame.enableCache) ? frame.number : frame.sample;
+	frame.aoShiftR = halton(aoShift, 5);
+	frame.aoShiftG = halton(aoShift, 7);
+
+	lastFrame = frame;
+
+}
+
+// Whether two frames show the same image, all but their progressive samples being equal
+bool RayEngine::frameSameView(const FrameState& a, const FrameState& b) {
+
+	return a.scene == b.scene && a.width == b.width && a.height == b.height && a.scale == b.scale &&
+		a.embreeOffset == b.embreeOffset && a.embreeWidth == b.embreeWidth &&
+		a.rayOrg == b.rayOrg && a.rayXaxis == b.rayXaxis && a.rayYaxis == b.rayYaxis && a.rayZaxis == b.rayZaxis &&
+		a.enableReflections == b.enableReflections && a.enableRefractions == b.enableRefractions && a.enableAo == b.enableAo &&
+		a.enableAdaptiveAo == b.enableAdaptiveAo && a.maxReflections == b.maxReflections && a.maxRefractions == b.maxRefractions &&
+		a.aoSamples == b.aoSamples && a.aoPower == b.aoPower && a.aoNoiseScale == b.aoNoiseScale;
+
+}
+
 void RayEngine::resize() {
 
+	settingsChange();
 	embreeResize();
 	embreeUpdatePartition();
 	optixResize();
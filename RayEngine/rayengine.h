@@ -7,7 +7,13 @@
 #include "scene.h"
 #include "font.h"
 #include "settings.h"
+#include "embree_packet.h"
+#include "worker_pool.h"
+#include "numa.h"
+#include "ao_cache.h"
 
+#include <cassert>
+#include <memory>
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
 #include <optixu/optixpp_namespace.h>
@@ -35,7 +41,6 @@ struct RayEngine {
 	int selectedScene;
 	Scene* curScene;
 	Camera* curCamera;
-	Vec3 rayOrg, rayXaxis, rayYaxis, rayZaxis;
 
 	Scene* createScene(string name, string skyFile = "", Color ambient = { 0.f }, float aoRadius = 5.f, Color skyColor = { 0.f });
 	void cameraInput();
@@ -50,13 +55,74 @@ struct RayEngine {
 	};
 
 	RenderMode renderMode;
-	bool enableCameraPath, enableReflections, enableRefractions, enableAo;
+	bool enableCameraPath, enableReflections, enableRefractions, enableAo, enableAdaptiveAo, enableAoCache;
 	int maxReflections, maxRefractions;
 	int aoSamples, aoSamplesSqrt;
-	float aoPower, aoNoiseScale;
+	float aoPower, aoNoiseScale, aoCacheCell;
 	void aoInit();
 	Image* aoNoiseImage;
 
+	//// Frame ////
+
+	// AO strata as the cosine and sine of their first azimuth and their lowest u1, padded to the widest packet.
+	// order is the stratum of every sample, ordered so that any prefix covers the hemisphere. A table is
+	// never changed once built, so frames share it.
+	struct AoTable {
+		vector<float> cosPhi, sinPhi, u1;
+		vector<int> order;
+	};
+
+	// Jitter of a hit's AO samples within their strata: added to u1, and the azimuth rotation
+	struct AoJitter {
+		float u1, cosPhi, sinPhi;
+	};
+
+	// What a frame is rendered with: the scene, camera basis, resolution and trace settings. It is
+	// built once per frame and passed to the render paths, which don't read the fields the input and
+	// settings change, so a frame can be traced while the last one is uploaded.
+	struct FrameState {
+		Scene* scene;
+		int width, height; // Render resolution, the window's scaled by scale
+		int windowWidth, windowHeight; // Window the frame is upscaled to
+		float scale;
+		int embreeOffset, embreeWidth; // Columns rendered by Embree
+		Vec3 rayOrg, rayXaxis, rayYaxis, rayZaxis;
+		bool enableReflections, enableRefractions, enableAo, enableAdaptiveAo, enableAoCache;
+		int maxReflections, maxRefractions;
+		int aoSamples, aoSamplesSqrt;
+		float aoPower, aoNoiseScale, aoCacheCell; // The AO cache cell in world units
+		float focusX, focusY; // Where the frame budget starts rendering, in render pixels
+		shared_ptr<const AoTable> aoTable;
+
+		// Embree paths and their settings
+		bool enableTiles, enableCostScheduling, enableAdaptiveTiles, enableWavefront, enablePacketsPrimary, enablePacketsSecondary, enableBinning, enableBudget;
+		int tileWidth, tileHeight, packetWidth;
+		float budgetMs;
+
+		// With progressive accumulation every frame of an unchanged view has the same view number
+		// (0 when off) and the next sample number, which shifts the primary rays within their pixels
+		// and the AO strata (by a value added to the noise, wrapping around)
+		int view, sample;
+		float jitterX, jitterY, aoShiftR, aoShiftG;
+
+		// Counts the frames since the last setting change (from 1), the temporal cache is only
+		// reused by a later frame
+		int number;
+		bool enableCache;
+		int traceFeatures; // TraceFeature flags of the trace kernel for primary rays
+
+		// Checkerboard frames trace the pixels of one parity, which embreeRender flips every frame
+		bool enableCheckerboard;
+		int checkerParity;
+	};
+
+	FrameState frameBuild();
+	void frameAdvance(FrameState& frame);
+	bool frameSameView(const FrameState& a, const FrameState& b);
+	FrameState lastFrame; // Compared with the next frame to find an unchanged view, its view is 0 after setting changes
+	int lastView;
+	static int frameScaleSize(int size, float scale) { return max(1, (int)(size * scale + 0.5f)); }
+
 	struct Setting {
 
 		Setting(string name, void* variable, bool isBool, float delta, float mi, float ma, float def, function<void()> func);
@@ -90,15 +156,35 @@ struct RayEngine {
 	Setting* settingMaxRefractions;
 	Setting* settingEnableAo;
 	Setting* settingAoSamples;
+	Setting* settingAoEnableAdaptive;
+	Setting* settingAoEnableCache;
+	Setting* settingAoCacheCell;
 	Setting* settingAoRadius;
 	Setting* settingAoPower;
 	Setting* settingAoNoiseScale;
 	Setting* settingEmbreeNumThreads;
+	Setting* settingEmbreeEnableNuma;
+	Setting* settingEmbreeEnableNumaReplication;
 	Setting* settingEmbreeEnableTiles;
 	Setting* settingEmbreeEnablePacketsPrimary;
 	Setting* settingEmbreeEnablePacketsSecondary;
+	Setting* settingEmbreeEnableWavefront;
+	Setting* settingEmbreeFrameMode;
+	Setting* settingEmbreeEnableProgressive;
+	Setting* settingEmbreeEnableCache;
+	Setting* settingEmbreeEnableCheckerboard;
+	Setting* settingEmbreeEnableBinning;
+	Setting* settingEmbreePacketWidth;
 	Setting* settingEmbreeTileWidth;
 	Setting* settingEmbreeTileHeight;
+	Setting* settingEmbreeEnableCostScheduling;
+	Setting* settingEmbreeEnableAdaptiveTiles;
+	Setting* settingEmbreeDisplayTiles;
+	Setting* settingEmbreeEnableBudget;
+	Setting* settingEmbreeBudget;
+	Setting* settingEmbreeBudgetAtCursor;
+	Setting* settingEmbreeEnableDynamicResolution;
+	Setting* settingEmbreeTargetTime;
 	Setting* settingOptixEnableProgressive;
 	Setting* settingOptixStackSize;
 	Setting* settingHybridEnableThreaded;
@@ -111,6 +197,7 @@ struct RayEngine {
 	int selectedSetting;
 
 	void settingsInit();
+	void settingsChange();
 	void settingsInput();
 	void settingsUpdate();
 	void saveRender();
@@ -143,6 +230,13 @@ struct RayEngine {
 	void benchmarkUpdate();
 	void benchmarkStart();
 	void benchmarkStop();
+	void benchmarkSecondary();
+	void benchmarkHitDecode();
+	void benchmarkNuma();
+	void benchmarkTiles();
+	void benchmarkAoCache();
+	void benchmarkCheckerboard();
+	void benchmarkShading();
 
 	//// OpenGL ////
 
@@ -176,6 +270,25 @@ struct RayEngine {
 
 	//// Embree ///
 
+	// Features compiled into a trace kernel, see embreeRenderTraceRay
+	enum TraceFeature {
+		TF_REFLECTIONS = 1 << 0,
+		TF_REFRACTIONS = 1 << 1,
+		TF_AO          = 1 << 2,
+		TF_MULTI_LIGHT = 1 << 3,
+		TF_SPECULAR    = 1 << 4,
+		TF_CACHE       = 1 << 5, // Primary rays with the temporal cache, the rays they spawn go without
+		TF_ALL         = (1 << 6) - 1
+	};
+
+	// How a frame reaches the screen: rendered and uploaded in turn, rendered while the last one is
+	// uploaded, or rendered on a thread of its own while the loop keeps presenting
+	enum FrameMode {
+		FM_SERIAL,
+		FM_PIPELINED,
+		FM_RENDER_THREAD
+	};
+
 	struct Embree {
 
 		struct Ray : RTCRay {
@@ -186,40 +299,383 @@ struct RayEngine {
 			float attenuation;
 		};
 
-		struct RayPacket : EMBREE_PACKET_TYPE {
-			int valid[EMBREE_PACKET_SIZE];
+		template<int N>
+		struct RayPacket : EmbreePacket<N>::Ray {
+			int valid[N];
 			int x, y;
 		};
 
-		struct LightRayPacket : RayPacket {
-			float attenuation[EMBREE_PACKET_SIZE];
-			float distance[EMBREE_PACKET_SIZE];
-			Vec3 incidence[EMBREE_PACKET_SIZE];
+		template<int N>
+		struct LightRayPacket : RayPacket<N> {
+			float attenuation[N];
+			float distance[N];
+			Vec3 incidence[N];
+		};
+
+		// A queued ray of the wavefront pipeline, carrying its throughput to the pixel
+		struct WavefrontRay : Ray {
+			Color weight;
+			int reflectDepth, refractDepth;
+		};
+
+		// A queued shadow or AO ray of the wavefront pipeline, pointing back to its hit
+		struct WavefrontLightRay : LightRay {
+			int hit, light;
+			Vec3 incidence;
+		};
+
+		// A shaded hit of the wavefront pipeline, waiting for its light and AO results
+		struct WavefrontHit {
+			int x, y;
+			Color weight, texture, diffuse, specular;
+			float transparency, occluded;
+			Vec3 pos, normal;
+			Material* material;
+		};
+
+		// Per-thread queues of the wavefront pipeline, reused between tiles
+		struct Wavefront {
+			vector<WavefrontRay> rays, nextRays, binnedRays;
+			vector<WavefrontLightRay> shadowRays, aoRays, binnedLightRays;
+			vector<WavefrontHit> hits;
+			vector<uint> binKeys, binStarts;
+
+			// Shadow rays traced per light, how many fell back to single rays, and the time spent
+			vector<uint> shadowCount, shadowSingleCount;
+			vector<double> shadowTime;
 		};
 
 		RTCDevice device;
-		vector<Color> buffer;
+
+		FrameMode frameMode;
+
+		// The frame being rendered, and the one whose image is displayed
+		FrameState frame, displayFrame;
+
+		// The buffer is rendered to and resolved into image, which is swapped with
+		// displayImage for uploading once the frame is done
+		NumaArray<Color> buffer;
+		vector<Color> image, displayImage;
+		bool displayUploaded;
 		GLuint texture;
 		int offset, width;
-		bool enableTiles, enablePacketsPrimary, enablePacketsSecondary;
+		bool enableTiles, enablePacketsPrimary, enablePacketsSecondary, enableWavefront, enableBinning;
 		int tileWidth, tileHeight, numThreads;
 
-		Timer renderTimer, textureTimer;
+		// With NUMA enabled the workers are pinned to the nodes, each rendering a band of rows
+		// whose part of the buffer is on its node, and the hit decode tables can be copied to every node
+		bool enableNuma, enableNumaReplication;
+		vector<Wavefront> wavefronts;
+
+		// With tiles enabled the buffer is stored tile by tile (tiles of the whole window in rows),
+		// and the tiles are rendered along a Morton curve
+		bool tiledBuffer;
+		int tileShiftX, tileShiftY, bufferTilesX, bufferTilesY;
+		int orderTilesX, orderTilesY;
+		vector<int> tileOrder;
+
+		// Render time of each tile in the last frame, its running average and the camera it was
+		// rendered with, used to dispatch the tiles predicted to be the most expensive first
+		bool enableCostScheduling;
+		vector<float> tileCosts, tileCostAverages, tilePredictedCosts;
+		int costTilesX, costTilesY;
+		Vec3 costXaxis, costYaxis, costZaxis;
+
+		// The areas handed to the threads. Without adaptive tiles there is one per tile, otherwise
+		// cheap tiles are merged into blocks and expensive ones split into smaller pieces.
+		struct TileTask {
+			int x0, y0, x1, y1;
+			float predictedCost, cost;
+			bool skipped;
+		};
+		bool enableAdaptiveTiles, displayTiles;
+		vector<TileTask> tileTasks;
+
+		// With a frame budget the tasks are started nearest the focus (the center or the cursor) first,
+		// and those that would end after the budget are skipped, keeping the last frame's pixels
+		bool enableBudget, budgetAtCursor;
+		float budgetMs;
+		int skippedTiles;
+
+		// With dynamic resolution the frames are rendered at a scale of the window picked to hold the
+		// target time, and upscaled after they're resolved. pixelCost is the running average render time
+		// per pixel. The column taps of the upscale are kept for the sizes they were built for.
+		bool enableDynamicResolution;
+		float targetMs, scale, pixelCost;
+		vector<Color> upscaleRows;
+		vector<int> upscaleColumns;
+		vector<float> upscaleColumnWeights;
+		int upscaleSrcWidth, upscaleSrcHeight, upscaleWidth;
+
+		// Progressive accumulation: the running average of the frames of a view
+		bool enableProgressive;
+		vector<Color> accumulation;
+		int accumulatedView, accumulatedFrames;
+
+		// Temporal cache: the surface point, shadow visibility of the first lights and mean occlusion
+		// of every primary hit. Written into nextCache by pixel, which becomes the cache read by the
+		// next frame, which finds a hit's entry by projecting it into cacheFrame's view.
+		struct CacheEntry {
+			Vec3 pos;
+			uint instID, geomID, primID;
+			float occluded;
+			float shadow[EMBREE_CACHE_LIGHTS];
+		};
+		bool enableCache, cacheReuse;
+		vector<CacheEntry> cache, nextCache;
+		FrameState cacheFrame;
+		float cacheHitRate;
+
+		// Checkerboard rendering: every frame traces the pixels of one parity, alternating, and fills in
+		// the others from the last frame where it saw the primitive of a neighbour at its depth, or else
+		// from the neighbours along the direction their depths change least. checkerInfo holds the primitive
+		// and depth of every pixel when it was last traced, checkerReuse the part filled from the last frame.
+		struct CheckerPixel {
+			uint instID, geomID, primID;
+			float depth;
+		};
+		bool enableCheckerboard, checkerHistory;
+		int checkerStep;
+		vector<CheckerPixel> checkerInfo;
+		FrameState checkerFrame;
+		float checkerReuse;
+
+		// World-space AO cache, allocated when first used and emptied for a new scene or cell size
+		AoCache aoCache;
+		Scene* aoCacheScene;
+
+		// Persistent threads rendering the tiles (or rows) of a frame. The balance of the run that
+		// traced the last frame is kept, the runs resolving the image come after it.
+		WorkerPool pool;
+		float tailTime, idleTime;
+		int steals;
+
+		// What the GUI shows about a frame, taken when it finishes and displayed along with it
+		struct FrameStats {
+			float renderTime, avgRenderTime, tailTime, idleTime, resolveTime;
+			int steals;
+			uint filterCalls;
+			float aoSamplesPerHit, cacheHitRate, checkerReuse;
+			int skippedTiles, accumulatedFrames, aoCacheCells;
+			vector<TileTask> tileTasks;
+		};
+		FrameStats displayStats;
+
+		// Render thread and its mailbox. The loop posts the newest FrameState, replacing one that
+		// hasn't started, and the thread publishes every finished frame into readyImage, replacing
+		// one that wasn't taken. With image and displayImage that makes three buffers, so the
+		// loop presents and handles input without waiting for the frame being rendered.
+		thread renderThread;
+		mutex renderLock;
+		condition_variable renderRequested, renderPublished;
+		FrameState requestedFrame, readyFrame;
+		vector<Color> readyImage;
+		FrameStats readyStats;
+		bool hasRequest, hasReady, rendering, renderQuit;
+
+		// AO table of the current sample count, copied into every frame
+		shared_ptr<const AoTable> aoTable;
+
+		// Trace kernel for the enabled features, picked from one kernel per feature combination
+		typedef void (RayEngine::*TraceRayKernel)(Ray& ray, int reflectDepth, int refractDepth, Color& result);
+		int traceFeatures;
+		TraceRayKernel traceRayKernels[TF_ALL + 1];
+
+		// Packet width setting and the kernels compiled for every width, picked by the frame's width
+		int packetWidth, maxPacketWidth;
+		struct PacketKernels {
+			void (RayEngine::*firePrimaryPacket)(int x, int y, int x1);
+			void (RayEngine::*wavefrontIntersect)(vector<WavefrontRay>& rays);
+			void (RayEngine::*wavefrontOccluded)(vector<WavefrontLightRay>& rays);
+			void (RayEngine::*wavefrontShadows)(Wavefront& wavefront);
+			float (RayEngine::*traceAo)(Vec3 pos, Vec3 normal, Color noise, int samples);
+		};
+		PacketKernels packetKernels[3]; // 4, 8 and 16 wide, see embreePacketKernels
+
+		// Per-thread memory for the packet tracing state of every recursion level. It is reserved
+		// before the frame by embreeReserveScratch, then handed out and released in stack order.
+		struct Scratch {
+			char* memory;
+			size_t size, used;
+		};
+
+		struct ScratchFrame {
+
+			Scratch& scratch;
+			size_t start;
+
+			ScratchFrame(Scratch& scratch) : scratch(scratch), start(scratch.used) {}
+			~ScratchFrame() { scratch.used = start; }
+
+			// Returns uninitialized, cache-aligned room for count elements. embreeReserveScratch
+			// sizes the memory for the deepest recursion, so running out is a bug.
+			template<typename T> __forceinline T* alloc(int count) {
+				size_t offset = (scratch.used + 63) & ~(size_t)63;
+				scratch.used = offset + sizeof(T) * count;
+				assert(scratch.used <= scratch.size);
+				return (T*)(scratch.memory + offset);
+			}
+
+		};
+
+		vector<Scratch> scratch;
+
+		// Occlusion filter calls, AO samples and the hits they were traced for, temporal cache lookups
+		// and hits, and shaded hits of every depth of the last frame. Counted per thread on separate
+		// cache lines, which the vector only keeps apart with an aligned allocator.
+		struct __declspec(align(64)) ThreadCounter {
+			uint filterCalls, aoHits, aoSamples, cacheLookups, cacheHits, shadedHits;
+		};
+		vector<ThreadCounter, AlignedAllocator<ThreadCounter, 64>> threadCounters;
+		uint filterCalls, shadedHits;
+		float aoSamplesPerHit;
+
+		// resolveTimer times the copy of the buffer into the image, see embreeResolveImage
+		Timer renderTimer, textureTimer, resolveTimer;
 
 	} Embree;
 
 	void embreeInit();
+	void embreeUpdateThreads(int numNodes = -1);
+	int embreeDetectPacketWidth();
+	void embreeInitPacketKernels();
 	void embreeUpdatePartition();
 	void embreeResize();
-	void embreeRender();
+	void embreeRender(const FrameState& frame);
+	void embreeStartRenderThread();
+	void embreeStopRenderThread();
+	void embreeRenderThreadLoop();
+	void embreeRenderThreadWait();
+	void embreeRequestFrame(const FrameState& frame);
+	bool embreeTakeFrame(bool wait = false);
+	void embreeCollectStats(Embree::FrameStats& stats);
+	void embreeRenderPresent();
+	void embreeUpdateScale();
+	void embreeUpscaleImage();
 	void embreeRenderFirePrimaryRay(int x, int y);
-	void embreeRenderFirePrimaryPacket(int x, int y);
-	void embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int refractDepth, Color& result);
-	void embreeRenderTracePacket(Embree::RayPacket& packet, int reflectDepth, int refractDepth, Color* result);
+	template<int N> void embreeRenderFirePrimaryPacket(int x, int y, int x1);
+	template<int F> void embreeRenderTraceRay(Embree::Ray& ray, int reflectDepth, int refractDepth, Color& result);
+	void embreeInitTraceKernels();
+	void embreeInitAoTable();
+	template<int N> float embreeRenderTraceAo(Vec3 pos, Vec3 normal, Color noise, int samples);
+	float embreeRenderCachedAo(Vec3 pos, Vec3 normal, Color noise);
+	void embreeUpdateTraceKernel();
+	template<int N> void embreeRenderTracePacket(Embree::RayPacket<N>& packet, int reflectDepth, int refractDepth, Color* result);
+	void embreeReserveScratch();
+	void embreeRenderWavefront(int x0, int y0, int x1, int y1);
+	void embreeRenderWavefrontShade(Embree::Wavefront& wavefront, Embree::WavefrontRay& ray);
+	template<int N> void embreeRenderWavefrontIntersect(vector<Embree::WavefrontRay>& rays);
+	template<int N> void embreeRenderWavefrontOccluded(vector<Embree::WavefrontLightRay>& rays);
+	template<int N> void embreeRenderWavefrontShadows(Embree::Wavefront& wavefront);
+	template<typename T> void embreeRenderWavefrontBin(vector<T>& rays, vector<T>& binned, Embree::Wavefront& wavefront);
 	void embreeRenderUpdateTexture();
+	void embreeUpdateTileLayout();
+	void embreeScheduleTiles();
+	void embreeAddTileTask(int x0, int y0, int x1, int y1, float cost, float splitCost);
+	void embreeUpdateTileCosts();
+	void embreeClearArea(int x0, int y0, int x1, int y1);
+	void embreeRenderTileOverlay();
+	void embreeResolveImage();
+	void embreeReconstructCheckerboard();
+	void embreeAccumulateImage();
+
+	// Returns the NUMA node whose band of the buffer holds a row of pixels
+	__forceinline int embreeRowNode(int y) {
+		if (Embree.tiledBuffer)
+			return (y >> Embree.tileShiftY) * Embree.pool.getNumNodes() / Embree.bufferTilesY;
+		return y * Embree.pool.getNumNodes() / Embree.frame.height;
+	}
+
+	// Returns the AO noise of a pixel, shifted for the sample of a progressive frame
+	__forceinline Color embreeAoNoise(int x, int y) {
+		Vec2 texCoord = Vec2((float)(Embree.frame.embreeOffset + x) / Embree.frame.width, (float)y / Embree.frame.height) * Embree.frame.aoNoiseScale;
+		Color noise = aoNoiseImage->getPixel(texCoord);
+		float r = noise.r() + Embree.frame.aoShiftR, g = noise.g() + Embree.frame.aoShiftG;
+		return Color(r - floor(r), g - floor(g), noise.b(), noise.a());
+	}
+
+	// Returns the jitter of the AO strata for the noise of a hit, red for u1 and green for the azimuth
+	__forceinline AoJitter embreeAoJitter(const Color& noise) {
+		float invSamplesSqrt = 1.f / Embree.frame.aoSamplesSqrt;
+		float phi = noise.g() * invSamplesSqrt * 2.f * M_PIf;
+		return { noise.r() * invSamplesSqrt, cos(phi), sin(phi) };
+	}
+
+	// Returns AO sample a of a hit, from its stratum of the AO table jittered and cosine-weighted
+	// into the hit's orthogonal base, as cosine_sample_hemisphere
+	__forceinline Vec3 embreeAoSample(int a, const AoJitter& jitter, const optix::Onb& onb) {
+		const AoTable& table = *Embree.frame.aoTable;
+		float u1 = table.u1[a] + jitter.u1;
+		float r = sqrt(u1);
+		float x = r * (table.cosPhi[a] * jitter.cosPhi - table.sinPhi[a] * jitter.sinPhi);
+		float y = r * (table.sinPhi[a] * jitter.cosPhi + table.cosPhi[a] * jitter.sinPhi);
+		float z = sqrt(max(0.f, 1.f - u1));
+		return Vec3(x * onb.m_tangent.x + y * onb.m_binormal.x + z * onb.m_normal.x,
+					x * onb.m_tangent.y + y * onb.m_binormal.y + z * onb.m_normal.y,
+					x * onb.m_tangent.z + y * onb.m_binormal.z + z * onb.m_normal.z);
+	}
+
+	// Returns the last frame's temporal cache entry of a primary hit, or nullptr if it wasn't there.
+	// The hit is projected into the cached view, and the entry at the nearest pixel must be the same
+	// primitive at the same point.
+	__forceinline const Embree::CacheEntry* embreeCacheLookup(const Embree::Ray& ray, const Vec3& pos) {
+
+		const FrameState& cached = Embree.cacheFrame;
+		Embree::ThreadCounter& counter = Embree.threadCounters[WorkerPool::getWorkerIndex()];
+		counter.cacheLookups++;
+		if (!Embree.cacheReuse)
+			return nullptr;
+
+		Vec3 toPos = pos - cached.rayOrg;
+		float depth = Vec3::dot(toPos, cached.rayZaxis);
+		if (depth <= 0.f)
+			return nullptr;
+
+		float dx = Vec3::dot(toPos, cached.rayXaxis) / (depth * Vec3::dot(cached.rayXaxis, cached.rayXaxis));
+		float dy = Vec3::dot(toPos, cached.rayYaxis) / (depth * Vec3::dot(cached.rayYaxis, cached.rayYaxis));
+		int x = (int)floor((dx + 1.f) * 0.5f * cached.width - cached.embreeOffset - cached.jitterX + 0.5f);
+		int y = (int)floor((dy + 1.f) * 0.5f * cached.height - cached.jitterY + 0.5f);
+		if (x < 0 || x >= cached.embreeWidth || y < 0 || y >= cached.height)
+			return nullptr;
+
+		const Embree::CacheEntry& entry = Embree.cache[y * cached.width + x];
+		if (entry.geomID != ray.geomID || entry.instID != ray.instID || entry.primID != ray.primID ||
+			Vec3::length(entry.pos - pos) > EMBREE_CACHE_TOLERANCE * depth)
+			return nullptr;
+
+		counter.cacheHits++;
+		return &entry;
+
+	}
+
+	// Returns the packet kernels of the frame's packet width
+	__forceinline const Embree::PacketKernels& embreePacketKernels() {
+		return Embree.packetKernels[Embree.frame.packetWidth >> 3];
+	}
+
+	// Returns the first pixel from x0 traced in a row, the next are every Embree.checkerStep pixels
+	__forceinline int embreeCheckerStart(int x0, int y) {
+		return x0 + ((Embree.checkerStep - 1) & (Embree.frame.embreeOffset + x0 + y + Embree.frame.checkerParity));
+	}
+
+	// Stores the primitive and depth of a primary ray for the checkerboard reconstruction
+	__forceinline void embreeCheckerStore(int x, int y, uint instID, uint geomID, uint primID, float depth) {
+		if (Embree.frame.enableCheckerboard)
+			Embree.checkerInfo[y * Embree.frame.width + x] = { instID, geomID, primID, depth };
+	}
+
+	// Returns the index of a pixel in the Embree buffer
+	__forceinline int embreeBufferIndex(int x, int y) {
+		if (!Embree.tiledBuffer)
+			return y * Embree.frame.width + x;
+		int tile = (y >> Embree.tileShiftY) * Embree.bufferTilesX + (x >> Embree.tileShiftX);
+		return (tile << (Embree.tileShiftX + Embree.tileShiftY)) + ((y & (Embree.frame.tileHeight - 1)) << Embree.tileShiftX) + (x & (Embree.frame.tileWidth - 1));
+	}
 	Color embreeRenderSky(Vec3 dir);
+	void embreeOccluded(Embree::LightRay& ray);
+	template<int N> void embreeOccludedPacket(Embree::LightRayPacket<N>& packet);
 	static void embreeOcclusionFilter(void* data, Embree::LightRay& ray);
-	static void embreeOcclusionFilter8(int* valid, void* data, Embree::LightRayPacket& packet);
+	template<int N> static void embreeOcclusionFilterPacket(int* valid, void* data, Embree::LightRayPacket<N>& packet);
 
 	//// OptiX ////
 
@@ -240,7 +696,7 @@ struct RayEngine {
 	void optixSetScene(Scene* scene);
 	void optixUpdatePartition();
 	void optixResize();
-	void optixRender();
+	void optixRender(const FrameState& frame);
 	void optixRenderUpdateTexture();
 
 	//// Hybrid ////
@@ -261,7 +717,7 @@ struct RayEngine {
 	} Hybrid;
 
 	void hybridInit();
-	void hybridRender();
+	void hybridRender(const FrameState& frame);
 	void hybridRenderUpdatePartition();
 
 };
\ No newline at end of file
@@ -12,19 +12,28 @@ void RayEngine::saveRender() {
 	window.height = 1080;
 	window.ratio = 1920.f / 1080.f;
 
-	rayXaxis = curCamera->xaxis * window.ratio * curCamera->tFov;
-	rayYaxis = -curCamera->yaxis * curCamera->tFov;
-	rayZaxis = curCamera->zaxis;
-
 	if (renderMode == RM_EMBREE) {
 		embreeResize();
 		embreeUpdatePartition();
-		embreeRender();
-		buf = &Embree.buffer[0];
 	} else if (renderMode == RM_OPTIX) {
 		optixResize();
 		optixUpdatePartition();
-		optixRender();
+	}
+
+	// Built after the resize for the partition of the screenshot, which is rendered at full resolution
+	// with every pixel traced
+	FrameState frame = frameBuild();
+	frame.scale = 1.f;
+	frame.enableCheckerboard = false;
+	frame.width = frame.windowWidth = window.width;
+	frame.height = frame.windowHeight = window.height;
+	frame.embreeWidth = Embree.width;
+
+	if (renderMode == RM_EMBREE) {
+		embreeRender(frame);
+		buf = &Embree.image[0];
+	} else if (renderMode == RM_OPTIX) {
+		optixRender(frame);
 		buf = (Color*)Optix.renderBuffer->map();
 	}
 
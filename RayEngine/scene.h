@@ -7,6 +7,45 @@
 #include "object.h"
 #include "light.h"
 #include "path.h"
+#include "worker_pool.h"
+
+// Everything needed to shade a hit on one mesh of one scene instance, kept in one entry so that
+// decoding a hit does not go through the instance and geometry maps. The table is only read
+// while rendering, so the entries are left at their natural alignment.
+struct EmbreeHitDecode {
+
+	// Returns an interpolated normal in world space (not normalized)
+	__forceinline Vec3 getNormal(int primID, float u, float v) const {
+		const TrianglePrimitive& prim = indexData[primID];
+		Vec3 n = (1.f - u - v) * normalData[prim.indices[0]] + u * normalData[prim.indices[1]] + v * normalData[prim.indices[2]];
+		return Vec3(
+			normalMatrix[0] * n.x() + normalMatrix[1] * n.y() + normalMatrix[2] * n.z(),
+			normalMatrix[3] * n.x() + normalMatrix[4] * n.y() + normalMatrix[5] * n.z(),
+			normalMatrix[6] * n.x() + normalMatrix[7] * n.y() + normalMatrix[8] * n.z()
+		);
+	}
+
+	// Returns an interpolated texture coordinate
+	__forceinline Vec2 getTexCoord(int primID, float u, float v) const {
+		const TrianglePrimitive& prim = indexData[primID];
+		return (1.f - u - v) * texCoordData[prim.indices[0]] + u * texCoordData[prim.indices[1]] + v * texCoordData[prim.indices[2]];
+	}
+
+	// Mesh data
+	Object* obj;
+	TriangleMesh* mesh;
+	Vec3* normalData;
+	Vec2* texCoordData;
+	TrianglePrimitive* indexData;
+	float normalMatrix[9]; // Upper 3x3 of the object matrix, row by row
+
+	// Material shading constants
+	Material* material;
+	Image* image;
+	Color ambient, diffuse, specular;
+	float shineExponent, reflectIntensity, refractIndex;
+
+};
 
 struct Scene {
 
@@ -42,9 +81,21 @@ struct Scene {
 	struct Embree {
 		RTCScene scene;
 		map<uint, Object*> instIDmap;
+		bool hasSpecular;
+
+		// Hit decode table, the entries of an instance start at hitDecodeStart[instID] and are indexed by geomID.
+		// Workers read it through hitDecodeNodes, the table itself or a copy on their NUMA node.
+		vector<EmbreeHitDecode> hitDecode;
+		vector<uint> hitDecodeStart;
+		vector<EmbreeHitDecode*> hitDecodeNodes;
+
+		__forceinline const EmbreeHitDecode& getHit(uint instID, uint geomID) const {
+			return hitDecodeNodes[WorkerPool::getWorkerNode()][hitDecodeStart[instID] + geomID];
+		}
 	} Embree;
 
-	void embreeInit(RTCDevice device);
+	void embreeInit(RTCDevice device, WorkerPool& pool);
+	void embreeReplicateHitDecode(int numNodes, bool replicate);
 
 	//// OptiX ////
 
@@ -1,5 +1,4 @@
 #include "rayengine.h"
-#include <omp.h>
 
 void RayEngine::settingsInit() {
 
@@ -27,9 +26,9 @@ void RayEngine::settingsInit() {
 	settingCameraPath = addSettingVariableBool("Camera path", &enableCameraPath, false);
 
 	// Reflections/Refractions
-	settingEnableReflections = addSettingVariableBool("Reflections", &enableReflections, ENABLE_REFLECTIONS);
+	settingEnableReflections = addSettingVariableBool("Reflections", &enableReflections, ENABLE_REFLECTIONS, [this]() { embreeUpdateTraceKernel(); });
 	settingMaxReflections = addSetting("Max reflections");
-	settingEnableRefractions = addSettingVariableBool("Refractions", &enableRefractions, ENABLE_REFRACTIONS);
+	settingEnableRefractions = addSettingVariableBool("Refractions", &enableRefractions, ENABLE_REFRACTIONS, [this]() { embreeUpdateTraceKernel(); });
 	settingMaxRefractions = addSetting("Max refractions");
 	for (int i = 0; i < 32; i++) {
 		settingMaxReflections->addOption(to_string(i), MAX_REFLECTIONS == i, [this, i]() { maxReflections = i; });
@@ -37,18 +36,23 @@ void RayEngine::settingsInit() {
 	}
 
 	// Ambient occlusion
-	settingEnableAo = addSettingVariableBool("Ambient Occlusion", &enableAo, ENABLE_AO);
+	settingEnableAo = addSettingVariableBool("Ambient Occlusion", &enableAo, ENABLE_AO, [this]() { embreeUpdateTraceKernel(); });
 	settingAoSamples = addSetting("AO samples");
 	for (int i = 2; i <= AO_SAMPLES_SQRT_MAX; i++)
-		settingAoSamples->addOption(to_string(i * i), AO_SAMPLES_SQRT == i, [this, i]() { aoSamplesSqrt = i; aoSamples = i * i; });
+		settingAoSamples->addOption(to_string(i * i), AO_SAMPLES_SQRT == i, [this, i]() { aoSamplesSqrt = i; aoSamples = i * i; embreeInitAoTable(); });
+	settingAoEnableAdaptive = addSettingVariableBool("Adaptive AO", &enableAdaptiveAo, AO_ENABLE_ADAPTIVE);
+	settingAoEnableCache = addSettingVariableBool("AO cache", &enableAoCache, AO_ENABLE_CACHE);
+	settingAoCacheCell = addSettingVariable("AO cache cell", &aoCacheCell, 0.05f, 0.05f, 4.f, AO_CACHE_CELL);
 	settingAoRadius = addSettingVariable("AO radius", nullptr, 0.05f, 0.f, 1000.f, 0.f, [this]() { settingAoRadius->delta = *((float*)settingAoRadius->variable) * 0.1f; });
 	settingAoPower = addSettingVariable("AO power", &aoPower, 0.025f, 0.f, 10.f, AO_POWER);
 	settingAoNoiseScale = addSettingVariable("AO noise scale", &aoNoiseScale, 2.f, 1.f, 100.f, AO_NOISE_SCALE);
 	
 	// Embree settings
 	settingEmbreeNumThreads = addSetting("Embree threads");
-	for (int i = 1; i <= 32; i++)
-		settingEmbreeNumThreads->addOption(to_string(i), EMBREE_NUM_THREADS == i, [this, i]() { omp_set_num_threads(i); });
+	for (int i = 1; i <= WorkerPool::getNumHardwareThreads(); i++)
+		settingEmbreeNumThreads->addOption(to_string(i), Embree.numThreads == i, [this, i]() { Embree.numThreads = i; embreeUpdateThreads(); });
+	settingEmbreeEnableNuma = addSettingVariableBool("NUMA", &Embree.enableNuma, EMBREE_ENABLE_NUMA, [this]() { embreeUpdateThreads(); });
+	settingEmbreeEnableNumaReplication = addSettingVariableBool("Replicate tables", &Embree.enableNumaReplication, EMBREE_ENABLE_NUMA_REPLICATION, [this]() { embreeUpdateThreads(); });
 	settingEmbreeEnableTiles = addSettingVariableBool("Embree tiles", &Embree.enableTiles, EMBREE_ENABLE_TILES);
 	settingEmbreeTileWidth = addSetting("Width");
 	settingEmbreeTileHeight = addSetting("Height");
@@ -56,8 +60,28 @@ void RayEngine::settingsInit() {
 		settingEmbreeTileWidth->addOption(to_string(i),  EMBREE_TILE_WIDTH == i,  [this, i]() { Embree.tileWidth = i; });
 		settingEmbreeTileHeight->addOption(to_string(i), EMBREE_TILE_HEIGHT == i, [this, i]() { Embree.tileHeight = i; });
 	}
+	settingEmbreeEnableCostScheduling = addSettingVariableBool("Cost scheduling", &Embree.enableCostScheduling, EMBREE_ENABLE_COST_SCHEDULING);
+	settingEmbreeEnableAdaptiveTiles = addSettingVariableBool("Adaptive tiles", &Embree.enableAdaptiveTiles, EMBREE_ENABLE_ADAPTIVE_TILES);
+	settingEmbreeDisplayTiles = addSettingVariableBool("Display tiles", &Embree.displayTiles, EMBREE_DISPLAY_TILES);
+	settingEmbreeEnableBudget = addSettingVariableBool("Frame budget", &Embree.enableBudget, EMBREE_ENABLE_BUDGET);
+	settingEmbreeBudget = addSettingVariable("Budget ms", &Embree.budgetMs, 1.f, 1.f, 1000.f, EMBREE_BUDGET_MS);
+	settingEmbreeBudgetAtCursor = addSettingVariableBool("Budget at cursor", &Embree.budgetAtCursor, EMBREE_BUDGET_AT_CURSOR);
 	settingEmbreeEnablePacketsPrimary = addSettingVariableBool("Embree primary packets", &Embree.enablePacketsPrimary, EMBREE_ENABLE_PACKETS_PRIMARY);
 	settingEmbreeEnablePacketsSecondary = addSettingVariableBool("Secondary packets", &Embree.enablePacketsSecondary, EMBREE_ENABLE_PACKETS_SECONDARY);
+	settingEmbreeEnableDynamicResolution = addSettingVariableBool("Dynamic resolution", &Embree.enableDynamicResolution, EMBREE_ENABLE_DYNAMIC_RESOLUTION, [this]() { Embree.scale = 1.f; Embree.pixelCost = 0.f; });
+	settingEmbreeTargetTime = addSettingVariable("Target ms", &Embree.targetMs, 1.f, 1.f, 1000.f, EMBREE_TARGET_MS);
+	settingEmbreeEnableProgressive = addSettingVariableBool("Progressive", &Embree.enableProgressive, EMBREE_ENABLE_PROGRESSIVE);
+	settingEmbreeEnableCache = addSettingVariableBool("Temporal cache", &Embree.enableCache, EMBREE_ENABLE_CACHE);
+	settingEmbreeEnableCheckerboard = addSettingVariableBool("Checkerboard", &Embree.enableCheckerboard, EMBREE_ENABLE_CHECKERBOARD);
+	settingEmbreeFrameMode = addSetting("Embree frame mode");
+	settingEmbreeFrameMode->addOption("Serial",        EMBREE_FRAME_MODE == FM_SERIAL,        [this]() { Embree.frameMode = FM_SERIAL; });
+	settingEmbreeFrameMode->addOption("Pipelined",     EMBREE_FRAME_MODE == FM_PIPELINED,     [this]() { Embree.frameMode = FM_PIPELINED; });
+	settingEmbreeFrameMode->addOption("Render thread", EMBREE_FRAME_MODE == FM_RENDER_THREAD, [this]() { Embree.frameMode = FM_RENDER_THREAD; });
+	settingEmbreeEnableWavefront = addSettingVariableBool("Embree wavefront", &Embree.enableWavefront, EMBREE_ENABLE_WAVEFRONT);
+	settingEmbreeEnableBinning = addSettingVariableBool("Ray binning", &Embree.enableBinning, EMBREE_ENABLE_BINNING);
+	settingEmbreePacketWidth = addSetting("Embree packet width");
+	for (int i = 4; i <= Embree.maxPacketWidth; i *= 2)
+		settingEmbreePacketWidth->addOption(to_string(i), Embree.packetWidth == i, [this, i]() { Embree.packetWidth = i; });
 
 	// OptiX settings
 	settingOptixEnableProgressive = addSettingVariableBool("OptiX progressive render", &Optix.enableProgressive, OPTIX_ALLOW_PROGRESSIVE && OPTIX_ENABLE_PROGRESSIVE);
@@ -78,7 +102,7 @@ void RayEngine::settingsInit() {
 
 	// Add scenes
 	for (int i = 0; i < scenes.size(); i++)
-		settingScene->addOption(scenes[i]->name, i == 0, [this, i]() { curScene = scenes[i]; curCamera = &curScene->camera; settingAoRadius->variable = &curScene->aoRadius; });
+		settingScene->addOption(scenes[i]->name, i == 0, [this, i]() { curScene = scenes[i]; curCamera = &curScene->camera; settingAoRadius->variable = &curScene->aoRadius; embreeUpdateTraceKernel(); });
 
 }
 
@@ -157,8 +181,25 @@ string RayEngine::Setting::getLogText() {
 
 }
 
+// Finishes the render thread's frame before the loop changes anything it reads (settings, the scene,
+// the window size), and starts a new view for progressive accumulation and the temporal cache
+void RayEngine::settingsChange() {
+
+	embreeRenderThreadWait();
+	lastFrame.view = 0;
+	lastFrame.number = 0;
+
+}
+
 void RayEngine::settingsInput() {
 
+	// Benchmarks, screenshots and comparisons change settings and scenes while they run
+	for (int key = GLFW_KEY_F2; key <= GLFW_KEY_F10; key++)
+		if (window.keyPressed[key]) {
+			settingsChange();
+			break;
+		}
+
 	// Toggle GUI
 
 	if (window.keyPressed[GLFW_KEY_F1])
@@ -179,6 +220,41 @@ void RayEngine::settingsInput() {
 	if (window.keyPressed[GLFW_KEY_F3])
 		saveRender();
 
+	// Compare secondary ray paths
+
+	if (window.keyPressed[GLFW_KEY_F4])
+		benchmarkSecondary();
+
+	// Compare hit decoding
+
+	if (window.keyPressed[GLFW_KEY_F5])
+		benchmarkHitDecode();
+
+	// Compare NUMA scaling
+
+	if (window.keyPressed[GLFW_KEY_F6])
+		benchmarkNuma();
+
+	// Compare tile scheduling
+
+	if (window.keyPressed[GLFW_KEY_F7])
+		benchmarkTiles();
+
+	// Compare the AO cache
+
+	if (window.keyPressed[GLFW_KEY_F8])
+		benchmarkAoCache();
+
+	// Compare the checkerboard
+
+	if (window.keyPressed[GLFW_KEY_F9])
+		benchmarkCheckerboard();
+
+	// Compare packet shading
+
+	if (window.keyPressed[GLFW_KEY_F10])
+		benchmarkShading();
+
 	// Print camera
 
 	if (window.keyPressed[GLFW_KEY_F11]) {
@@ -216,6 +292,7 @@ void RayEngine::settingsInput() {
 			if (curSetting->isBool) { // Switch between false and true
 
 				if (window.keyPressed[GLFW_KEY_LEFT] || window.keyPressed[GLFW_KEY_RIGHT]) {
+					settingsChange();
 					*((bool*)curSetting->variable) = !*((bool*)curSetting->variable);
 					if (curSetting->func)
 						curSetting->func();
@@ -225,6 +302,7 @@ void RayEngine::settingsInput() {
 			} else { // Increase/decrease
 
 				if (window.keyDown[GLFW_KEY_LEFT]) {
+					settingsChange();
 					*((float*)curSetting->variable) = clamp(*((float*)curSetting->variable) - curSetting->delta, curSetting->mi, curSetting->ma);
 					if (curSetting->func)
 						curSetting->func();
@@ -232,6 +310,7 @@ void RayEngine::settingsInput() {
 				}
 
 				if (window.keyDown[GLFW_KEY_RIGHT]) {
+					settingsChange();
 					*((float*)curSetting->variable) = clamp(*((float*)curSetting->variable) + curSetting->delta, curSetting->mi, curSetting->ma);
 					if (curSetting->func)
 						curSetting->func();
@@ -244,6 +323,7 @@ void RayEngine::settingsInput() {
 
 			if (window.keyPressed[GLFW_KEY_LEFT]) {
 
+				settingsChange();
 				if (curSetting->options.size() > 2)
 					curSetting->selectedOption = clamp(curSetting->selectedOption - 1, 0, curSetting->options.size() - 1);
 				else
@@ -258,6 +338,7 @@ void RayEngine::settingsInput() {
 
 			if (window.keyPressed[GLFW_KEY_RIGHT]) {
 
+				settingsChange();
 				if (curSetting->options.size() > 2)
 					curSetting->selectedOption = clamp(curSetting->selectedOption + 1, 0, curSetting->options.size() - 1);
 				else
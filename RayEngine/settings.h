@@ -19,13 +19,52 @@
 #define AO_NOISE_WIDTH 50
 #define AO_NOISE_HEIGHT 50
 #define AO_POWER 1.f
-
-#define EMBREE_NUM_THREADS 16
+#define AO_ENABLE_ADAPTIVE 0				// Stop sampling a hit once its AO estimate has converged
+#define AO_ADAPTIVE_BATCH 8				// Samples traced before the first convergence check and between checks
+#define AO_ADAPTIVE_ERROR 0.02f				// Standard error of the mean occlusion counted as converged
+#define AO_ENABLE_CACHE 0					// Share running AO estimates of world-space cells between pixels and frames
+#define AO_CACHE_CELL 0.25f					// Size of a cell, relative to the scene's AO radius
+#define AO_CACHE_CELLS (1 << 20)
+#define AO_CACHE_PROBES 8					// Cells tried for a point before it's traced without the cache
+#define AO_CACHE_BATCH 4					// Samples a hit adds to its cell
+#define AO_CACHE_FILL 4						// A cell is full once it has this many times the AO samples of a pixel
+#define AO_CACHE_PRECISION 256.f			// Steps per sample of the summed occlusion
+
+#define EMBREE_NUM_THREADS 0				// 0 = One per hardware thread
+#define EMBREE_ENABLE_NUMA 0				// Pin the threads to NUMA nodes and keep their memory there
+#define EMBREE_ENABLE_NUMA_REPLICATION 1	// Copy the hit decode tables to every NUMA node
 #define EMBREE_ENABLE_TILES 1				// 1 = Split into tiles, 0 = Use a single loop
+#define EMBREE_FRAME_MODE FM_SERIAL				// FM_SERIAL, FM_PIPELINED or FM_RENDER_THREAD
 #define EMBREE_TILE_WIDTH 16
 #define EMBREE_TILE_HEIGHT 16
+#define EMBREE_ENABLE_COST_SCHEDULING 0	// Dispatch the tiles that were slowest in the last frame first
+#define EMBREE_ENABLE_ADAPTIVE_TILES 0		// Merge cheap tiles and split expensive ones by their average cost
+#define EMBREE_ADAPTIVE_MERGE 4				// Most tiles per side merged into one block
+#define EMBREE_ADAPTIVE_SPLIT 2.f			// Tiles costing more than this times the average are split
+#define EMBREE_COST_BLEND 0.25f				// Weight of the last frame in the tile cost averages
+#define EMBREE_DISPLAY_TILES 0
+#define EMBREE_ENABLE_BUDGET 0				// Skip the tiles that don't fit in the frame budget, keeping the last frame there
+#define EMBREE_BUDGET_MS 33.f
+#define EMBREE_BUDGET_AT_CURSOR 0			// 1 = Render outward from the cursor, 0 = From the center
+#define EMBREE_ENABLE_DYNAMIC_RESOLUTION 0	// Scale the render resolution to hold the target time
+#define EMBREE_TARGET_MS (1000.f / BENCHMARK_TARGET_FPS)
+#define EMBREE_MIN_SCALE 0.25f
+#define EMBREE_SCALE_HYSTERESIS 0.05f		// Scale change needed before the resolution follows
+#define EMBREE_SCALE_BLEND 0.25f			// Weight of the last frame in the time per pixel
+#define EMBREE_ENABLE_PROGRESSIVE 0			// Average the frames while the view doesn't change
+#define EMBREE_ENABLE_CACHE 0				// Reuse the shadow and AO results of the last frame's surface points
+#define EMBREE_CACHE_LIGHTS 4				// Lights whose shadows are cached, the others are traced every frame
+#define EMBREE_CACHE_REFRESH 4				// Frames a cached shadow is reused for before it's traced again
+#define EMBREE_CACHE_AO_FRACTION 0.25f		// Part of the AO samples traced for a cached point
+#define EMBREE_CACHE_BLEND 0.2f				// Weight of the new AO samples in a cached point's occlusion
+#define EMBREE_CACHE_TOLERANCE 0.01f		// Distance to the cached point, relative to its depth, counted as the same point
+#define EMBREE_ENABLE_CHECKERBOARD 0		// Trace half the pixels every frame, alternating, and reconstruct the others
+#define EMBREE_CHECKER_TOLERANCE 0.02f		// Depth difference, relative to the depth, of pixels counted as the same surface
 #define EMBREE_ENABLE_PACKETS_PRIMARY 1		// 1 = Use packets for primary rays, 0 = Shoot single rays
 #define EMBREE_ENABLE_PACKETS_SECONDARY 0	// 1 = Use packets for secondary rays (eg. shadows, reflections), 0 = use single rays
+#define EMBREE_PACKET_WIDTH 0				// Lanes per packet (4, 8 or 16), 0 = Widest supported by the CPU
+#define EMBREE_ENABLE_WAVEFRONT 0			// 1 = Trace each tile bounce by bounce from ray queues, 0 = Recurse per pixel
+#define EMBREE_ENABLE_BINNING 1				// 1 = Sort wavefront secondary rays by direction and origin before packing, 0 = Pack in queue order
 
 #define OPTIX_ENABLE_PROGRESSIVE 0
 #define OPTIX_NUM_THREADS 1					// Does this affect Embree?
@@ -44,6 +83,13 @@
 #define LOG(x) logFileStream << x << endl
 
 #define BENCHMARK_TARGET_FPS 30				// The frames per second for camera paths when benchmarking
+#define BENCHMARK_SECONDARY_FRAMES 20		// Frames rendered per scene and path when comparing secondary ray paths
+#define BENCHMARK_DECODE_REPEATS 20			// Times every primary hit is decoded when comparing hit decoding
+#define BENCHMARK_NUMA_FRAMES 20			// Frames rendered per configuration when comparing NUMA scaling
+#define BENCHMARK_TILES_SCENE "Glass"		// Scene whose camera path is rendered when comparing tile scheduling
+#define BENCHMARK_AO_CACHE_FRAMES 20		// Frames rendered per path without and with the AO cache when comparing them
+#define BENCHMARK_CHECKER_SCENE "Glass"		// Scene whose camera path is rendered when comparing the checkerboard
+#define BENCHMARK_SHADING_FRAMES 20			// Frames rendered per path when comparing SIMD and single hit shading
 
 //// OpenGL compile settings ////
 
@@ -52,15 +98,15 @@
 //// Embree compile settings ////
 
 #define EMBREE_HIGHLIGHT_COLOR Color(0.6f, 0.6f, 1.f)
-#define EMBREE_ONE_LIGHT 1					// Limit to one light to get rid of some loops
-#define EMBREE_PACKET_SIZE 8
-#define EMBREE_PACKET_TYPE RTCRay8
+#define EMBREE_MAX_LIGHTS 4					// Lights traced by the packet path
 #define EMBREE_SFLAGS_SCENE RTC_SCENE_STATIC | RTC_SCENE_COHERENT | RTC_SCENE_HIGH_QUALITY
 #define EMBREE_SFLAGS_OBJECT RTC_SCENE_STATIC | RTC_SCENE_COHERENT | RTC_SCENE_HIGH_QUALITY
-#define EMBREE_AFLAGS_SCENE RTC_INTERSECT8 | RTC_INTERSECT1
-#define EMBREE_AFLAGS_OBJECT RTC_INTERSECT8 | RTC_INTERSECT1
+#define EMBREE_AFLAGS_SCENE RTC_INTERSECT16 | RTC_INTERSECT8 | RTC_INTERSECT4 | RTC_INTERSECT1
+#define EMBREE_AFLAGS_OBJECT RTC_INTERSECT16 | RTC_INTERSECT8 | RTC_INTERSECT4 | RTC_INTERSECT1
 #define EMBREE_RAY_VALID -1
 #define EMBREE_RAY_INVALID 0
+#define EMBREE_BIN_CELLS_BITS 3				// Origin cells per axis (as a power of two) when binning secondary rays
+#define EMBREE_SHADOW_SPREAD_COS 0.95f		// Shadow packets whose directions spread wider than this angle (as a cosine) are traced as single rays
 
 //// OptiX compile settings ////
 
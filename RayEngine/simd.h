@@ -0,0 +1,176 @@
+#pragma once
+
+#include <immintrin.h>
+#include <cfloat>
+
+// SIMD registers of floats for the packet shading kernels. vfloat4 is an SSE register, vfloat8 an
+// AVX one. Comparisons return masks of all set or all clear bits per lane, which select() and the
+// bitwise operators take. The project is compiled for AVX without AVX2, so the integer parts of
+// exp() and log() are done in 128-bit halves.
+
+struct vfloat4 {
+
+	__m128 v;
+	static const int size = 4;
+
+	//// Constructors ////
+
+	__forceinline vfloat4() {}
+	__forceinline vfloat4(__m128 v) : v(v) {}
+	__forceinline explicit vfloat4(float f) : v(_mm_set1_ps(f)) {}
+	static __forceinline vfloat4 bits(int b) { return _mm_castsi128_ps(_mm_set1_epi32(b)); }
+
+	static __forceinline vfloat4 load(const float* p) { return _mm_loadu_ps(p); }
+	static __forceinline vfloat4 loadMask(const int* p) { return _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)p)); }
+	__forceinline void store(float* p) const { _mm_storeu_ps(p, v); }
+	__forceinline void storeMask(int* p) const { _mm_storeu_si128((__m128i*)p, _mm_castps_si128(v)); }
+
+	//// Integer parts ////
+
+	// The unbiased exponent of every lane as a float
+	__forceinline vfloat4 exponent() const {
+		__m128i e = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(v), 23), _mm_set1_epi32(127));
+		return _mm_cvtepi32_ps(e);
+	}
+
+	// 2 to the power of every lane, which must be a whole number within the float exponent range
+	__forceinline vfloat4 pow2i() const {
+		__m128i e = _mm_add_epi32(_mm_cvttps_epi32(v), _mm_set1_epi32(127));
+		return _mm_castsi128_ps(_mm_slli_epi32(e, 23));
+	}
+
+};
+
+__forceinline vfloat4 operator+(const vfloat4& a, const vfloat4& b) { return _mm_add_ps(a.v, b.v); }
+__forceinline vfloat4 operator-(const vfloat4& a, const vfloat4& b) { return _mm_sub_ps(a.v, b.v); }
+__forceinline vfloat4 operator*(const vfloat4& a, const vfloat4& b) { return _mm_mul_ps(a.v, b.v); }
+__forceinline vfloat4 operator/(const vfloat4& a, const vfloat4& b) { return _mm_div_ps(a.v, b.v); }
+__forceinline vfloat4 operator&(const vfloat4& a, const vfloat4& b) { return _mm_and_ps(a.v, b.v); }
+__forceinline vfloat4 operator|(const vfloat4& a, const vfloat4& b) { return _mm_or_ps(a.v, b.v); }
+__forceinline vfloat4 operator<(const vfloat4& a, const vfloat4& b) { return _mm_cmplt_ps(a.v, b.v); }
+__forceinline vfloat4 operator>(const vfloat4& a, const vfloat4& b) { return _mm_cmpgt_ps(a.v, b.v); }
+__forceinline vfloat4 min(const vfloat4& a, const vfloat4& b) { return _mm_min_ps(a.v, b.v); }
+__forceinline vfloat4 max(const vfloat4& a, const vfloat4& b) { return _mm_max_ps(a.v, b.v); }
+__forceinline vfloat4 sqrt(const vfloat4& a) { return _mm_sqrt_ps(a.v); }
+__forceinline vfloat4 floor(const vfloat4& a) { return _mm_floor_ps(a.v); }
+__forceinline vfloat4 andnot(const vfloat4& mask, const vfloat4& a) { return _mm_andnot_ps(mask.v, a.v); }
+
+// Picks a where the mask is set, otherwise b
+__forceinline vfloat4 select(const vfloat4& mask, const vfloat4& a, const vfloat4& b) { return _mm_blendv_ps(b.v, a.v, mask.v); }
+
+struct vfloat8 {
+
+	__m256 v;
+	static const int size = 8;
+
+	//// Constructors ////
+
+	__forceinline vfloat8() {}
+	__forceinline vfloat8(__m256 v) : v(v) {}
+	__forceinline explicit vfloat8(float f) : v(_mm256_set1_ps(f)) {}
+	static __forceinline vfloat8 bits(int b) { return _mm256_castsi256_ps(_mm256_set1_epi32(b)); }
+
+	static __forceinline vfloat8 load(const float* p) { return _mm256_loadu_ps(p); }
+	static __forceinline vfloat8 loadMask(const int* p) { return _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)p)); }
+	__forceinline void store(float* p) const { _mm256_storeu_ps(p, v); }
+	__forceinline void storeMask(int* p) const { _mm256_storeu_si256((__m256i*)p, _mm256_castps_si256(v)); }
+
+	//// Integer parts ////
+
+	__forceinline vfloat8 exponent() const {
+		vfloat4 lo = vfloat4(_mm256_castps256_ps128(v)).exponent();
+		vfloat4 hi = vfloat4(_mm256_extractf128_ps(v, 1)).exponent();
+		return _mm256_insertf128_ps(_mm256_castps128_ps256(lo.v), hi.v, 1);
+	}
+
+	__forceinline vfloat8 pow2i() const {
+		vfloat4 lo = vfloat4(_mm256_castps256_ps128(v)).pow2i();
+		vfloat4 hi = vfloat4(_mm256_extractf128_ps(v, 1)).pow2i();
+		return _mm256_insertf128_ps(_mm256_castps128_ps256(lo.v), hi.v, 1);
+	}
+
+};
+
+__forceinline vfloat8 operator+(const vfloat8& a, const vfloat8& b) { return _mm256_add_ps(a.v, b.v); }
+__forceinline vfloat8 operator-(const vfloat8& a, const vfloat8& b) { return _mm256_sub_ps(a.v, b.v); }
+__forceinline vfloat8 operator*(const vfloat8& a, const vfloat8& b) { return _mm256_mul_ps(a.v, b.v); }
+__forceinline vfloat8 operator/(const vfloat8& a, const vfloat8& b) { return _mm256_div_ps(a.v, b.v); }
+__forceinline vfloat8 operator&(const vfloat8& a, const vfloat8& b) { return _mm256_and_ps(a.v, b.v); }
+__forceinline vfloat8 operator|(const vfloat8& a, const vfloat8& b) { return _mm256_or_ps(a.v, b.v); }
+__forceinline vfloat8 operator<(const vfloat8& a, const vfloat8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+__forceinline vfloat8 operator>(const vfloat8& a, const vfloat8& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+__forceinline vfloat8 min(const vfloat8& a, const vfloat8& b) { return _mm256_min_ps(a.v, b.v); }
+__forceinline vfloat8 max(const vfloat8& a, const vfloat8& b) { return _mm256_max_ps(a.v, b.v); }
+__forceinline vfloat8 sqrt(const vfloat8& a) { return _mm256_sqrt_ps(a.v); }
+__forceinline vfloat8 floor(const vfloat8& a) { return _mm256_floor_ps(a.v); }
+__forceinline vfloat8 andnot(const vfloat8& mask, const vfloat8& a) { return _mm256_andnot_ps(mask.v, a.v); }
+__forceinline vfloat8 select(const vfloat8& mask, const vfloat8& a, const vfloat8& b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+
+// The register a packet of N lanes is shaded with, 16 lanes take two AVX registers
+template<int N> struct PacketSimd { typedef vfloat8 Type; };
+template<> struct PacketSimd<4> { typedef vfloat4 Type; };
+
+// Natural logarithm of positive lanes, as Cephes' logf. Lanes of 0 give about -87.3 rather than -inf.
+template<typename V>
+__forceinline V simdLog(const V& a) {
+
+	V x = max(a, V(FLT_MIN));
+	V e = x.exponent() + V(1.f);
+
+	// The mantissa in [0.5, 1), moved to [sqrt(0.5), sqrt(2)) - 1
+	x = (x & V::bits(~0x7F800000)) | V(0.5f);
+	V small = x < V(0.707106781186547524f);
+	e = e - (V(1.f) & small);
+	x = x - V(1.f) + (x & small);
+
+	V z = x * x;
+	V y = V(7.0376836292e-2f);
+	y = y * x + V(-1.1514610310e-1f);
+	y = y * x + V(1.1676998740e-1f);
+	y = y * x + V(-1.2420140846e-1f);
+	y = y * x + V(1.4249322787e-1f);
+	y = y * x + V(-1.6668057665e-1f);
+	y = y * x + V(2.0000714765e-1f);
+	y = y * x + V(-2.4999993993e-1f);
+	y = y * x + V(3.3333331174e-1f);
+	y = y * x * z + e * V(-2.12194440e-4f) - z * V(0.5f);
+
+	return x + y + e * V(0.693359375f);
+
+}
+
+// Exponential of every lane, as Cephes' expf. Lanes are clamped to +-88.38, below it they give 0.
+template<typename V>
+__forceinline V simdExp(const V& a) {
+
+	V x = min(max(a, V(-88.3762626647949f)), V(88.3762626647949f));
+
+	// exp(a) = 2^n * exp(x - n * ln(2)), with ln(2) split in two for precision
+	V n = floor(x * V(1.44269504088896341f) + V(0.5f));
+	x = x - n * V(0.693359375f) - n * V(-2.12194440e-4f);
+
+	V z = x * x;
+	V y = V(1.9875691500e-4f);
+	y = y * x + V(1.3981999507e-3f);
+	y = y * x + V(8.3334519073e-3f);
+	y = y * x + V(4.1665795894e-2f);
+	y = y * x + V(1.6666665459e-1f);
+	y = y * x + V(5.0000001201e-1f);
+	y = y * z + x + V(1.f);
+
+	return y * n.pow2i();
+
+}
+
+// a to the power of b for positive a, the lanes of a that are 0 give 0
+template<typename V>
+__forceinline V simdPow(const V& a, const V& b) {
+	return select(a > V(0.f), simdExp(b * simdLog(a)), V(0.f));
+}
+
+__forceinline vfloat4 log(const vfloat4& a) { return simdLog(a); }
+__forceinline vfloat8 log(const vfloat8& a) { return simdLog(a); }
+__forceinline vfloat4 exp(const vfloat4& a) { return simdExp(a); }
+__forceinline vfloat8 exp(const vfloat8& a) { return simdExp(a); }
+__forceinline vfloat4 pow(const vfloat4& a, const vfloat4& b) { return simdPow(a, b); }
+__forceinline vfloat8 pow(const vfloat8& a, const vfloat8& b) { return simdPow(a, b); }
@@ -7,6 +7,8 @@
 #include <iomanip>
 #include <vector>
 #include <map>
+#include <malloc.h>
+#include <new>
 
 using namespace std;
 using namespace placeholders;
@@ -45,4 +47,37 @@ inline string date() {
 	localtime_s(&tstruct, &now);
 	strftime(buf, sizeof(buf), "%Y-%m-%d %H.%M.%S", &tstruct);
 	return buf;
-}
\ No newline at end of file
+}
+
+// Allocator for containers of over-aligned types, which the default allocator only aligns to 16 bytes
+template<typename T, size_t Alignment>
+struct AlignedAllocator {
+
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template<typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() {}
+	template<typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(size_t count) {
+		void* memory = _aligned_malloc(max(count, (size_t)1) * sizeof(T), Alignment);
+		if (!memory)
+			throw bad_alloc();
+		return (T*)memory;
+	}
+
+	void deallocate(T* memory, size_t) { _aligned_free(memory); }
+	template<typename U, typename... Args> void construct(U* p, Args&&... args) { new((void*)p) U(forward<Args>(args)...); }
+	template<typename U> void destroy(U* p) { p->~U(); }
+	size_t max_size() const { return ((size_t)-1) / sizeof(T); }
+
+	bool operator==(const AlignedAllocator&) const { return true; }
+	bool operator!=(const AlignedAllocator&) const { return false; }
+
+};
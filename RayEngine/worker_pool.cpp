@@ -0,0 +1,255 @@
+#include "worker_pool.h"
+#include "numa.h"
+
+#include <chrono>
+
+static __declspec(thread) int workerIndex = 0;
+__declspec(thread) int WorkerPool::workerNode = 0;
+
+WorkerPool::WorkerPool() :
+	lastIdleTime(0.f),
+	lastTailTime(0.f),
+	lastSteals(0),
+	numNodes(0),
+	runID(0),
+	workersBusy(0),
+	quit(false),
+	allowSteal(true)
+{
+}
+
+WorkerPool::~WorkerPool() {
+	stop();
+}
+
+void WorkerPool::start(int numWorkers, int numNodes) {
+
+	stop();
+
+	this->numNodes = min(numNodes, numWorkers);
+	for (int i = 0; i < numWorkers; i++) {
+		workers.push_back(new Worker());
+		workers[i]->node = i * getNumNodes() / numWorkers;
+	}
+
+	for (int i = 1; i < numWorkers; i++)
+		workers[i]->handle = thread(&WorkerPool::workerLoop, this, i);
+
+}
+
+void WorkerPool::stop() {
+
+	{
+		lock_guard<mutex> lock(runLock);
+		quit = true;
+	}
+	runStart.notify_all();
+
+	for (Worker* worker : workers) {
+		if (worker->handle.joinable())
+			worker->handle.join();
+		delete worker;
+	}
+
+	workers.clear();
+	quit = false;
+
+}
+
+void WorkerPool::run(int numTasks, function<void(int)> func, bool interleave, function<int(int)> taskNode) {
+
+	int numWorkers = workers.size();
+
+	// Without threads, run everything here
+	if (numWorkers <= 1) {
+		for (int t = 0; t < numTasks; t++)
+			func(t);
+		lastIdleTime = lastTailTime = 0.f;
+		lastSteals = 0;
+		return;
+	}
+
+	// Group the tasks by node, keeping their order
+	int nodes = taskNode ? getNumNodes() : 1;
+	vector<vector<int>> nodeTasks(nodes);
+	for (int t = 0; t < numTasks; t++)
+		nodeTasks[nodes > 1 ? min(max(taskNode(t), 0), nodes - 1) : 0].push_back(t);
+
+	// Deal the tasks of each node out to its workers in contiguous blocks, so neighbouring tasks start
+	// on the same worker, or in turn so that every worker starts with its share of the first tasks
+	int firstWorker = 0;
+	for (int n = 0; n < nodes; n++) {
+
+		int lastWorker = firstWorker;
+		while (lastWorker < numWorkers && (nodes == 1 || workers[lastWorker]->node == n))
+			lastWorker++;
+
+		vector<int>& tasks = nodeTasks[n];
+		int size = tasks.size(), nodeWorkers = lastWorker - firstWorker;
+
+		for (int w = 0; w < nodeWorkers; w++) {
+			Worker* worker = workers[firstWorker + w];
+			lock_guard<mutex> lock(worker->lock);
+			worker->tasks.clear();
+			if (interleave) {
+				for (int t = w; t < size; t += nodeWorkers)
+					worker->tasks.push_back(tasks[t]);
+			} else {
+				for (int t = w * size / nodeWorkers; t < (w + 1) * size / nodeWorkers; t++)
+					worker->tasks.push_back(tasks[t]);
+			}
+			worker->firstIdle = -1.0;
+			worker->steals = 0;
+		}
+
+		firstWorker = lastWorker;
+
+	}
+
+	this->func = func;
+
+	{
+		lock_guard<mutex> lock(runLock);
+		runID++;
+		workersBusy = numWorkers - 1;
+	}
+	runStart.notify_all();
+
+	// Work as worker 0 until no tasks are left, then wait for the others to finish theirs. The calling
+	// thread is only pinned to worker 0's node for the run, so it keeps its own affinity outside.
+	NumaAffinity prevAffinity;
+	bool pinned = isPinned() && numaPinThread(workers[0]->node, &prevAffinity);
+
+	int prevIndex = workerIndex, prevNode = workerNode;
+	workerIndex = 0;
+	workerNode = workers[0]->node;
+	work(0);
+	workerIndex = prevIndex;
+	workerNode = prevNode;
+
+	if (pinned)
+		numaRestoreThread(prevAffinity);
+
+	{
+		unique_lock<mutex> lock(runLock);
+		runDone.wait(lock, [this]() { return workersBusy == 0; });
+	}
+
+	// A worker is idle from running out of tasks until the run ends
+	double runEnd = getSeconds(), firstIdle = runEnd;
+	lastIdleTime = 0.f;
+	lastSteals = 0;
+	for (Worker* worker : workers) {
+		lastSteals += worker->steals;
+		if (worker->firstIdle >= 0.0) {
+			lastIdleTime += runEnd - worker->firstIdle;
+			firstIdle = min(firstIdle, worker->firstIdle);
+		}
+	}
+	lastTailTime = runEnd - firstIdle;
+
+}
+
+void WorkerPool::runOnEachWorker(function<void(int)> func) {
+
+	// One task per worker, none of which may be stolen
+	allowSteal = false;
+	run(workers.size(), func, true);
+	allowSteal = true;
+
+}
+
+int WorkerPool::getWorkerIndex() {
+	return workerIndex;
+}
+
+int WorkerPool::getNumHardwareThreads() {
+	return max(1, (int)thread::hardware_concurrency());
+}
+
+double WorkerPool::getSeconds() {
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void WorkerPool::workerLoop(int index) {
+
+	workerIndex = index;
+	workerNode = workers[index]->node;
+	if (isPinned())
+		numaPinThread(workerNode);
+
+	int lastRunID = 0;
+
+	while (true) {
+
+		{
+			unique_lock<mutex> lock(runLock);
+			runStart.wait(lock, [&]() { return quit || runID != lastRunID; });
+			if (quit)
+				return;
+			lastRunID = runID;
+		}
+
+		work(index);
+
+		{
+			lock_guard<mutex> lock(runLock);
+			workersBusy--;
+		}
+		runDone.notify_one();
+
+	}
+
+}
+
+// Runs tasks until none are left to take or steal. Tasks are never added during a run, so the
+// worker can leave then and wait for the next run instead of spinning through the others' tails.
+void WorkerPool::work(int index) {
+
+	int task;
+	while (getTask(index, task))
+		func(task);
+
+	workers[index]->firstIdle = getSeconds();
+
+}
+
+// Takes the next task of the worker, or steals the last task of another
+bool WorkerPool::getTask(int index, int& task) {
+
+	Worker* worker = workers[index];
+
+	{
+		lock_guard<mutex> lock(worker->lock);
+		if (!worker->tasks.empty()) {
+			task = worker->tasks.front();
+			worker->tasks.pop_front();
+			return true;
+		}
+	}
+
+	if (!allowSteal)
+		return false;
+
+	// Steal from the same node first, where the task's memory is
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 1; i < (int)workers.size(); i++) {
+
+			Worker* victim = workers[(index + i) % workers.size()];
+			if ((victim->node == worker->node) != (pass == 0))
+				continue;
+
+			lock_guard<mutex> lock(victim->lock);
+			if (!victim->tasks.empty()) {
+				task = victim->tasks.back();
+				victim->tasks.pop_back();
+				worker->steals++;
+				return true;
+			}
+
+		}
+	}
+
+	return false;
+
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "util.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+// Persistent threads that run the tasks of a frame. Every worker has a deque of tasks, taking
+// from the front of its own and stealing from the back of the others once it runs out.
+struct WorkerPool {
+
+	WorkerPool();
+	~WorkerPool();
+
+	// Creates the threads, the thread calling run() works as worker 0. With numNodes set, the
+	// workers are split over that many NUMA nodes in contiguous groups and pinned to them.
+	void start(int numWorkers, int numNodes = 0);
+
+	// Joins the threads.
+	void stop();
+
+	// Runs tasks 0 to numTasks - 1 and returns when all are done. The tasks are dealt out in
+	// contiguous blocks, or one at a time in turn if interleave is set (for tasks sorted by cost or priority).
+	// If taskNode is given, every task is dealt to the workers of the node it returns.
+	void run(int numTasks, function<void(int)> func, bool interleave = false, function<int(int)> taskNode = nullptr);
+
+	// Runs func once on every worker at the same time, passing the worker index. Used for work
+	// that expects a fixed team of threads, like Embree's rtcCommitThread.
+	void runOnEachWorker(function<void(int)> func);
+
+	// Returns the index of the calling worker, or 0 outside of the pool.
+	static int getWorkerIndex();
+
+	// Returns the number of hardware threads, the most workers the pool should have.
+	static int getNumHardwareThreads();
+
+	// Returns the node of the calling worker, or 0 outside of the pool.
+	static __forceinline int getWorkerNode() { return workerNode; }
+	static __declspec(thread) int workerNode;
+
+	// Returns a time in seconds for measuring intervals.
+	static double getSeconds();
+
+	int getNumWorkers() { return workers.size(); }
+	int getNumNodes() { return max(numNodes, 1); }
+	bool isPinned() { return numNodes > 0; }
+
+	// Statistics of the last run
+	float lastIdleTime; // Seconds the workers spent without tasks, summed
+	float lastTailTime; // Seconds from the first worker running out of tasks until the run finished
+	int lastSteals;
+
+	struct Worker {
+		thread handle;
+		mutex lock;
+		deque<int> tasks;
+		int node;
+		double firstIdle;
+		int steals;
+	};
+
+	void workerLoop(int index);
+	void work(int index);
+	bool getTask(int index, int& task);
+
+	vector<Worker*> workers;
+	int numNodes;
+	function<void(int)> func;
+
+	mutex runLock;
+	condition_variable runStart, runDone;
+	int runID, workersBusy;
+	bool quit, allowSteal;
+
+};